@@ -1,5 +1,7 @@
 #!/bin/bash
 
 file="$1"
+shift
 
-gcc -D__KERNEL__ -DMODULE -O2 -c "$file"
+# Any further arguments are passed to gcc, e.g. -DMORSE_RING_FEED
+gcc -D__KERNEL__ -DMODULE -O2 "$@" -c "$file"
@@ -9,26 +9,50 @@ Zajączkowski Piotr
 #include <linux/kernel.h>
 #include <linux/sched.h>
 #include <linux/fs.h>
+#include <linux/fcntl.h>
 #include <linux/errno.h>
 #include <linux/module.h>
 #include <linux/malloc.h>
 #include <linux/ioctl.h>
 #include <linux/timer.h>
+#include <linux/tty.h>
+#include <linux/vt_kern.h>
+#include <linux/stat.h>
+#include <linux/proc_fs.h>
 #include <asm/semaphore.h>
+#include <asm/system.h>
 
 #include "console_struct.h"
 
+extern unsigned long video_num_columns;
+extern unsigned long video_num_lines;
+
 #define MORSE_MAJOR 61
-#define DEVICES_COUNT 8
+#define DEVICES_COUNT 8 // unless set when loading
+#define MAX_DEVICES 128 // minors from DECODER_MINOR up are decoders
 #define DEFAULT_BUFFER_SIZE 256
 #define MIN_BUFFER_SIZE 0
 #define MAX_BUFFER_SIZE 1024
 
+// Minors from DECODER_MINOR up are decoders: timed samples in, text out
+#define DECODER_MINOR 128
+#define DECODERS_COUNT 8
+#define DECODER_BUFFER_SIZE 256
+#define DECODE_TRIE_SIZE (2 << MAX_CODE_LENGTH)
+#define DECODE_HISTORY 8      // samples held back until the speed is known
+#define DECODE_ROOM (2 * DECODE_HISTORY) // a gap ends a letter and a word
+
 #define DOT_DURATION 200 // milliseconds
 #define DASH_DURATION 600
 #define SYMBOL_PAUSE 200
 #define LETTER_PAUSE 600
 #define WORD_PAUSE 1400
+#define MAX_DURATION 60000
+
+#define MAX_WPM (HZ * 6 / 5) // a dot must last at least one jiffy
+
+// Durations are kept in 1/256 jiffy units
+#define JIFFY_SHIFT 8
 
 #define MORSE_IOC_SET_DOT_DURATION _IOW(MORSE_MAJOR, 1, int)
 #define MORSE_IOC_SET_DASH_DURATION _IOW(MORSE_MAJOR, 2, int)
@@ -37,227 +61,775 @@ Zajączkowski Piotr
 #define MORSE_IOC_SET_WORD_PAUSE _IOW(MORSE_MAJOR, 5, int)
 #define MORSE_IOC_SET_BUFFER_SIZE _IOW(MORSE_MAJOR, 6, int)
 #define MORSE_IOC_GET_BUFFER_SIZE _IOR(MORSE_MAJOR, 7, int *)
+#define MORSE_IOC_DRAIN _IO(MORSE_MAJOR, 8)
+#define MORSE_IOC_SET_SPEED _IOW(MORSE_MAJOR, 9, struct morse_speed)
+#define MORSE_IOC_SET_OUTPUT _IOW(MORSE_MAJOR, 10, int)
+#define MORSE_IOC_SET_SCREEN _IOW(MORSE_MAJOR, 11, struct morse_screen)
+#define MORSE_IOC_READ_EVENTS _IOWR(MORSE_MAJOR, 12, struct morse_event_log)
+#define MORSE_IOC_FLUSH _IO(MORSE_MAJOR, 13)
+#define MORSE_IOC_URGENT _IOW(MORSE_MAJOR, 14, struct morse_message)
+#define MORSE_IOC_GET_STATUS _IOR(MORSE_MAJOR, 15, struct morse_status)
+#define MORSE_IOC_SET_BEACON _IOW(MORSE_MAJOR, 16, struct morse_beacon)
+#define MORSE_IOC_ATTACH_RING _IOW(MORSE_MAJOR, 17, int) // ring minor, -1 detaches
+
+// Signal outputs
+#define MORSE_OUTPUT_SCREEN 0 // a character cell on a console
+#define MORSE_OUTPUT_BELL 1   // the console bell
+#define MORSE_OUTPUT_LOG 2    // none but the event log, which every output keeps
+#define OUTPUTS_COUNT 3
+
+#define EVENT_LOG_SIZE 128 // must be a power of two
+#define URGENT_SIZE 128	  // must be a power of two
+#define BEACON_SIZE 128
+
+// Where the timer takes characters from, in order of priority
+#define SOURCE_NONE -1
+#define SOURCE_URGENT 0
+#define SOURCE_BUFFER 1
+#define SOURCE_RING 2
+#define SOURCE_BEACON 3
+
+struct morse_speed
+{
+	int wpm;	    // character speed, words per minute
+	int farnsworth_wpm; // overall speed with Farnsworth spacing, 0 = wpm
+};
+
+struct morse_screen
+{
+	int console; // -1 = the foreground console
+	int row;
+	int column;
+	int colour; // attribute byte used while the signal is on
+};
+
+// A transition of the signal, as read() returns them
+struct morse_event
+{
+	unsigned long time; // jiffies
+	int state;	    // 0 = off, 1 = on
+	int character;	    // the byte being sent
+};
+
+struct morse_event_log
+{
+	int count; // in: room in events, out: number of events returned
+	struct morse_event *events;
+};
+
+struct morse_message
+{
+	int length;
+	const char *text;
+};
+
+// A message repeated whenever nothing else is queued
+struct morse_beacon
+{
+	int length; // 0 clears the beacon
+	const char *text;
+	int gap; // milliseconds of silence between repeats, on top of a
+		 // word pause
+};
+
+// What a device is doing, from MORSE_IOC_GET_STATUS and /proc/morse
+#define MORSE_ELEMENT_NONE 0 // not transmitting
+#define MORSE_ELEMENT_DOT 1
+#define MORSE_ELEMENT_DASH 2
+#define MORSE_ELEMENT_SYMBOL_PAUSE 3
+#define MORSE_ELEMENT_LETTER_PAUSE 4
+#define MORSE_ELEMENT_WORD_PAUSE 5
+#define MORSE_ELEMENT_BEACON_GAP 6
+
+struct morse_status
+{
+	int transmitting;
+	int queued;	  // bytes waiting in the buffer, the urgent queue
+			  // and the attached ring
+	int current_char; // byte being sent, -1 when idle
+	int element;	  // MORSE_ELEMENT_*
+	unsigned long eta; // milliseconds until everything queued is sent,
+			   // the beacon aside
+
+	// Counted since the module was loaded
+	unsigned long chars_sent;
+	unsigned long chars_skipped;  // bytes with no Morse code
+	unsigned long writer_sleeps;  // writes that waited for room
+	unsigned long timer_overruns; // elements that started late
+	unsigned long events_lost;    // transitions dropped, the event log
+				      // being full
+};
+
+// What is written to a decoder
+struct morse_sample
+{
+	int state;    // 1 = signal on, 0 = off
+	int duration; // in any unit, as long as all samples use the same one
+};
 
-// Morse code patterns
-static const char *morse_codes[] = {
-	".-",	// A
-	"-...", // B
-	"-.-.", // C
-	"-..",	// D
-	".",	// E
-	"..-.", // F
-	"--.",	// G
-	"....", // H
-	"..",	// I
-	".---", // J
-	"-.-",	// K
-	".-..", // L
-	"--",	// M
-	"-.",	// N
-	"---",	// O
-	".--.", // P
-	"--.-", // Q
-	".-.",	// R
-	"...",	// S
-	"-",	// T
-	"..-",	// U
-	"...-", // V
-	".--",	// W
-	"-..-", // X
-	"-.--", // Y
-	"--.."	// Z
+#ifdef MORSE_RING_FEED
+// Exported by the ring module, which must be loaded first
+extern int ring_attach(int minor, void (*notify)(unsigned long), unsigned long data);
+extern void ring_detach(int minor);
+extern int ring_count(int minor);
+extern int ring_peek_at(int minor, int offset);
+extern int ring_peek(int minor);
+extern int ring_consume(int minor);
+#endif
+
+#ifndef barrier
+#define barrier() __asm__ __volatile__("" : : : "memory")
+#endif
+
+// Morse code table, indexed by byte
+//
+// Each entry packs a whole code into a short: the elements are stored
+// first one lowest, a set bit for a dash, and are followed by a single
+// marker bit, so 1 is the empty code (a word gap) and 0 marks a byte
+// that cannot be sent. Sending a code is a matter of shifting it right
+// until only the marker is left.
+//
+// Prosigns that have no punctuation of their own are sent for the
+// control bytes closest in meaning: SOH for <KA> (starting signal), EOT
+// for <SK> (end of work), ACK for <VE> (understood), BEL for <SOS> and
+// BS for <HH> (error). '+', '=' and '&' are <AR>, <BT> and <AS>.
+#define DI  0
+#define DAH 1
+
+#define M1(a) (2 | (a))
+#define M2(a, b) (M1(b) << 1 | (a))
+#define M3(a, b, c) (M2(b, c) << 1 | (a))
+#define M4(a, b, c, d) (M3(b, c, d) << 1 | (a))
+#define M5(a, b, c, d, e) (M4(b, c, d, e) << 1 | (a))
+#define M6(a, b, c, d, e, f) (M5(b, c, d, e, f) << 1 | (a))
+#define M7(a, b, c, d, e, f, g) (M6(b, c, d, e, f, g) << 1 | (a))
+#define M8(a, b, c, d, e, f, g, h) (M7(b, c, d, e, f, g, h) << 1 | (a))
+#define M9(a, b, c, d, e, f, g, h, i) (M8(b, c, d, e, f, g, h, i) << 1 | (a))
+
+#define CODE_SPACE 1
+#define MAX_CODE_LENGTH 9
+
+#define LETTER(upper, code) [upper] = code, [upper - 'A' + 'a'] = code
+
+static const unsigned short morse_table[256] = {
+	[' '] = CODE_SPACE,
+	['\t'] = CODE_SPACE,
+	['\n'] = CODE_SPACE,
+
+	LETTER('A', M2(DI, DAH)),
+	LETTER('B', M4(DAH, DI, DI, DI)),
+	LETTER('C', M4(DAH, DI, DAH, DI)),
+	LETTER('D', M3(DAH, DI, DI)),
+	LETTER('E', M1(DI)),
+	LETTER('F', M4(DI, DI, DAH, DI)),
+	LETTER('G', M3(DAH, DAH, DI)),
+	LETTER('H', M4(DI, DI, DI, DI)),
+	LETTER('I', M2(DI, DI)),
+	LETTER('J', M4(DI, DAH, DAH, DAH)),
+	LETTER('K', M3(DAH, DI, DAH)),
+	LETTER('L', M4(DI, DAH, DI, DI)),
+	LETTER('M', M2(DAH, DAH)),
+	LETTER('N', M2(DAH, DI)),
+	LETTER('O', M3(DAH, DAH, DAH)),
+	LETTER('P', M4(DI, DAH, DAH, DI)),
+	LETTER('Q', M4(DAH, DAH, DI, DAH)),
+	LETTER('R', M3(DI, DAH, DI)),
+	LETTER('S', M3(DI, DI, DI)),
+	LETTER('T', M1(DAH)),
+	LETTER('U', M3(DI, DI, DAH)),
+	LETTER('V', M4(DI, DI, DI, DAH)),
+	LETTER('W', M3(DI, DAH, DAH)),
+	LETTER('X', M4(DAH, DI, DI, DAH)),
+	LETTER('Y', M4(DAH, DI, DAH, DAH)),
+	LETTER('Z', M4(DAH, DAH, DI, DI)),
+
+	['0'] = M5(DAH, DAH, DAH, DAH, DAH),
+	['1'] = M5(DI, DAH, DAH, DAH, DAH),
+	['2'] = M5(DI, DI, DAH, DAH, DAH),
+	['3'] = M5(DI, DI, DI, DAH, DAH),
+	['4'] = M5(DI, DI, DI, DI, DAH),
+	['5'] = M5(DI, DI, DI, DI, DI),
+	['6'] = M5(DAH, DI, DI, DI, DI),
+	['7'] = M5(DAH, DAH, DI, DI, DI),
+	['8'] = M5(DAH, DAH, DAH, DI, DI),
+	['9'] = M5(DAH, DAH, DAH, DAH, DI),
+
+	['.'] = M6(DI, DAH, DI, DAH, DI, DAH),
+	[','] = M6(DAH, DAH, DI, DI, DAH, DAH),
+	['?'] = M6(DI, DI, DAH, DAH, DI, DI),
+	['\''] = M6(DI, DAH, DAH, DAH, DAH, DI),
+	['!'] = M6(DAH, DI, DAH, DI, DAH, DAH),
+	['/'] = M5(DAH, DI, DI, DAH, DI),
+	['('] = M5(DAH, DI, DAH, DAH, DI),
+	[')'] = M6(DAH, DI, DAH, DAH, DI, DAH),
+	['&'] = M5(DI, DAH, DI, DI, DI),
+	[':'] = M6(DAH, DAH, DAH, DI, DI, DI),
+	[';'] = M6(DAH, DI, DAH, DI, DAH, DI),
+	['='] = M5(DAH, DI, DI, DI, DAH),
+	['+'] = M5(DI, DAH, DI, DAH, DI),
+	['-'] = M6(DAH, DI, DI, DI, DI, DAH),
+	['_'] = M6(DI, DI, DAH, DAH, DI, DAH),
+	['"'] = M6(DI, DAH, DI, DI, DAH, DI),
+	['$'] = M7(DI, DI, DI, DAH, DI, DI, DAH),
+	['@'] = M6(DI, DAH, DAH, DI, DAH, DI),
+
+	['\001'] = M5(DAH, DI, DAH, DI, DAH),		       // <KA>
+	['\004'] = M6(DI, DI, DI, DAH, DI, DAH),	       // <SK>
+	['\006'] = M5(DI, DI, DI, DAH, DI),		       // <VE>
+	['\007'] = M9(DI, DI, DI, DAH, DAH, DAH, DI, DI, DI), // <SOS>
+	['\010'] = M8(DI, DI, DI, DI, DI, DI, DI, DI),	       // <HH>
 };
 
-static const char *morse_digits[] = {
-	"-----", // 0
-	".----", // 1
-	"..---", // 2
-	"...--", // 3
-	"....-", // 4
-	".....", // 5
-	"-....", // 6
-	"--...", // 7
-	"---..", // 8
-	"----."	 // 9
+// Everything about one device. The fields the timer uses on every run
+// come first so that they share as few cache lines as possible: besides
+// the schedule, that is the output's configuration, the queue indices
+// and the wait queues woken as bytes and events move. The statistics,
+// what only process context touches and the queues' storage follow.
+//
+// The buffer is a single-producer, single-consumer queue: writers
+// (serialized by sem) only ever advance buffer_head and buffer_in, the
+// timer only ever advances buffer_tail and buffer_out. The timer can
+// therefore consume without taking any lock, and a writer sleeping on a
+// full buffer never holds anything the timer needs. Urgent messages,
+// which preempt the buffer at the next letter boundary, and the event
+// log are queues of the same kind.
+//
+// The beacon is only replaced with interrupts disabled, so the timer can
+// read it freely. It holds sendable bytes only, without leading or
+// trailing spaces, so a repeat always ends on a letter.
+struct morse_dev
+{
+	struct timer_list timer;
+
+	// Schedule: the jiffy the current element ends at, and the fraction
+	// of a jiffy carried over from rounding the previous elements
+	unsigned long deadline;
+	long timing_error;
+
+	// Timing configuration, in 1/256 jiffy units
+	unsigned long dot_duration;
+	unsigned long dash_duration;
+	unsigned long symbol_pause;
+	unsigned long letter_pause;
+	unsigned long word_pause;
+
+	volatile int is_transmitting;
+	int signal_state; // 0 = off, 1 = on
+	int output_type;
+	int current_element;
+	int current_source;
+	unsigned short current_code; // elements left to send, 0 = none
+	char current_char;
+	struct morse_screen screen_config;
+
+	// Consumer side of the queues, and who to wake as they move
+	char *buffer;
+	int buffer_size;
+	int buffer_tail;
+	volatile unsigned int buffer_in;  // bytes ever queued
+	volatile unsigned int buffer_out; // bytes ever sent
+	volatile unsigned int urgent_in;
+	volatile unsigned int urgent_out;
+	int ring_minor; // ring buffer fed from, -1 = none
+	int beacon_length;
+	int beacon_pos;
+	unsigned long beacon_gap; // added to the word pause between repeats
+	struct wait_queue *write_queue;
+	struct wait_queue *read_queue;
+	struct wait_queue *drain_queue;
+
+	// Event log, filled by set_signal() and drained by read() and
+	// MORSE_IOC_READ_EVENTS. New events are dropped while it is full.
+	volatile unsigned int event_in;
+	volatile unsigned int event_out;
+	unsigned long events_lost;
+
+	// Statistics, each counter only ever updated from one side
+	unsigned long chars_sent;
+	unsigned long chars_skipped;
+	unsigned long timer_overruns;
+	unsigned long writer_sleeps;
+
+	// Process context only
+	int buffer_head;
+	int device_in_use;
+	struct semaphore sem;
+
+	char urgent[URGENT_SIZE];
+	char beacon[BEACON_SIZE];
+	struct morse_event event_log[EVENT_LOG_SIZE];
 };
 
-// Timing configuration
-static int dot_duration[DEVICES_COUNT];
-static int dash_duration[DEVICES_COUNT];
-static int symbol_pause[DEVICES_COUNT];
-static int letter_pause[DEVICES_COUNT];
-static int word_pause[DEVICES_COUNT];
-
-// Buffer management
-static char *buffer[DEVICES_COUNT];
-static int buffer_size[DEVICES_COUNT];
-static int buffer_count[DEVICES_COUNT];
-static int buffer_head[DEVICES_COUNT];
-static int buffer_tail[DEVICES_COUNT];
-static int device_in_use[DEVICES_COUNT];
-
-// Synchronization and state management
-static struct semaphore sem[DEVICES_COUNT];
-static struct timer_list morse_timer[DEVICES_COUNT];
-static int is_transmitting[DEVICES_COUNT];
-static char current_char[DEVICES_COUNT];
-static const char *current_code[DEVICES_COUNT];
-static int code_position[DEVICES_COUNT];
-static int signal_state[DEVICES_COUNT]; // 0 = off, 1 = on
-struct wait_queue *write_queue[DEVICES_COUNT];
+// Number of devices, can be set when loading: insmod morse.o devices=16
+int devices = DEVICES_COUNT;
+
+static struct morse_dev **morse_devs;
 
 int get_minor(struct inode *inode)
 {
 	int minor = MINOR(inode->i_rdev);
-	if (minor >= DEVICES_COUNT)
+	if (minor >= devices)
 	{
 		return -ENODEV;
 	}
 	return minor;
 }
 
-void set_signal(int minor, int state)
+static inline int buffer_count(struct morse_dev *dev)
+{
+	return dev->buffer_in - dev->buffer_out;
+}
+
+// Producer side, called with sem held and only when there is room.
+static inline void buffer_put(struct morse_dev *dev, char ch)
+{
+	dev->buffer[dev->buffer_head] = ch;
+	if (++dev->buffer_head == dev->buffer_size)
+		dev->buffer_head = 0;
+	barrier(); // the byte must be stored before it is published
+	dev->buffer_in++;
+}
+
+// Consumer side, called only from the timer and only when the buffer
+// is not empty.
+static inline char buffer_get(struct morse_dev *dev)
+{
+	char ch = dev->buffer[dev->buffer_tail];
+
+	if (++dev->buffer_tail == dev->buffer_size)
+		dev->buffer_tail = 0;
+	barrier(); // the byte must be read before its slot is released
+	dev->buffer_out++;
+	return ch;
+}
+
+static inline int urgent_count(struct morse_dev *dev)
+{
+	return dev->urgent_in - dev->urgent_out;
+}
+
+static inline int next_source(struct morse_dev *dev)
+{
+	if (urgent_count(dev) > 0)
+		return SOURCE_URGENT;
+	if (buffer_count(dev) > 0)
+		return SOURCE_BUFFER;
+#ifdef MORSE_RING_FEED
+	if (dev->ring_minor >= 0 && ring_peek(dev->ring_minor) >= 0)
+		return SOURCE_RING;
+#endif
+	if (dev->beacon_length > 0)
+		return SOURCE_BEACON;
+	return SOURCE_NONE;
+}
+
+// True while anything but the beacon is queued or being sent
+static inline int drain_pending(struct morse_dev *dev)
+{
+	int source = next_source(dev);
+
+	if (!dev->is_transmitting)
+		return 0;
+	if (source != SOURCE_NONE && source != SOURCE_BEACON)
+		return 1;
+	return dev->current_source != SOURCE_NONE && dev->current_source != SOURCE_BEACON;
+}
+
+// The timer's view of a source, which must not be empty
+static inline char source_peek(struct morse_dev *dev, int source)
+{
+	if (source == SOURCE_URGENT)
+		return dev->urgent[dev->urgent_out & (URGENT_SIZE - 1)];
+	if (source == SOURCE_BEACON)
+		return dev->beacon[dev->beacon_pos];
+#ifdef MORSE_RING_FEED
+	if (source == SOURCE_RING)
+		return ring_peek(dev->ring_minor);
+#endif
+	return dev->buffer[dev->buffer_tail];
+}
+
+static char source_get(struct morse_dev *dev, int source)
+{
+	char ch;
+
+	if (source == SOURCE_URGENT)
+	{
+		ch = dev->urgent[dev->urgent_out & (URGENT_SIZE - 1)];
+		barrier(); // the byte must be read before its slot is released
+		dev->urgent_out++;
+		return ch;
+	}
+
+	if (source == SOURCE_BEACON)
+	{
+		ch = dev->beacon[dev->beacon_pos];
+		if (++dev->beacon_pos == dev->beacon_length)
+			dev->beacon_pos = 0;
+		return ch;
+	}
+
+#ifdef MORSE_RING_FEED
+	// The ring wakes its own writers
+	if (source == SOURCE_RING)
+		return ring_consume(dev->ring_minor);
+#endif
+
+	ch = buffer_get(dev);
+	wake_up(&dev->write_queue);
+	return ch;
+}
+
+// 256 / 1000000 = 16 / 62500, split so that nothing overflows 32 bits
+static unsigned long usecs_to_ticks(unsigned long usecs)
+{
+	return (usecs / 62500) * (HZ << 4) + ((usecs % 62500) * (HZ << 4) + 31250) / 62500;
+}
+
+static unsigned long msecs_to_ticks(unsigned long msecs)
+{
+	return usecs_to_ticks(msecs * 1000);
+}
+
+static int output_console(struct morse_dev *dev)
+{
+	if (dev->screen_config.console < 0)
+		return fg_console;
+	return dev->screen_config.console;
+}
+
+static void screen_output(struct morse_dev *dev, int state)
+{
+	unsigned short *screen;
+	int currcons = output_console(dev);
+
+	if (vc_cons[currcons].d == NULL)
+		return;
+
+	screen = (unsigned short *)origin;
+	screen += dev->screen_config.row * video_num_columns + dev->screen_config.column;
+
+	if (state)
+	{
+		*screen = (dev->screen_config.colour << 8) | ' ';
+	}
+	else
+	{
+		*screen = (0x0 << 12) | (0x0 << 8) | ' ';
+	}
+}
+
+// The bell is shared by all devices using it on the same console
+static void bell_output(struct morse_dev *dev, int state)
 {
-	unsigned long *screen;
-	int currcons = fg_console;
+	int currcons = output_console(dev);
 
-	screen = (unsigned long *)origin;
+	if (vc_cons[currcons].d == NULL)
+		return;
 
 	if (state)
 	{
-		screen[minor] = (0x4 << 12) | (0x4 << 8) | ' ';
+		kd_mksound(bell_pitch, 0);
 	}
 	else
 	{
-		screen[minor] = (0x0 << 12) | (0x0 << 8) | ' ';
+		kd_mksound(0, 0);
+	}
+}
+
+// Every output keeps the event log, so this one only leaves it alone
+static void log_output(struct morse_dev *dev, int state)
+{
+}
+
+struct morse_output
+{
+	const char *name;
+	void (*set)(struct morse_dev *dev, int state);
+};
+
+static struct morse_output outputs[OUTPUTS_COUNT] = {
+	{"screen", screen_output},
+	{"bell", bell_output},
+	{"log", log_output}};
+
+static void log_event(struct morse_dev *dev, int state)
+{
+	struct morse_event *event;
+
+	if (dev->event_in - dev->event_out == EVENT_LOG_SIZE)
+	{
+		dev->events_lost++;
+		return;
+	}
+
+	event = &dev->event_log[dev->event_in & (EVENT_LOG_SIZE - 1)];
+	event->time = jiffies;
+	event->state = state;
+	event->character = (unsigned char)dev->current_char;
+	barrier(); // the event must be stored before it is published
+	dev->event_in++;
+	wake_up_interruptible(&dev->read_queue);
+}
+
+void set_signal(struct morse_dev *dev, int state)
+{
+	outputs[dev->output_type].set(dev, state);
+	dev->signal_state = state;
+	log_event(dev, state);
+}
+
+// Called with interrupts disabled, so that it cannot race with the timer
+// deciding that the transmission is over. A running transmission holds
+// a module reference and keeps the buffer alive after the last close.
+static void start_transmission(struct morse_dev *dev)
+{
+	if (!dev->is_transmitting && next_source(dev) != SOURCE_NONE)
+	{
+		dev->is_transmitting = 1;
+		dev->current_source = SOURCE_NONE;
+		MOD_INC_USE_COUNT;
+		dev->deadline = jiffies + 1;
+		dev->timing_error = 0;
+		dev->timer.expires = dev->deadline;
+		add_timer(&dev->timer);
+	}
+}
+
+// Called from the timer, or with interrupts disabled and the timer
+// deleted. The buffer is never freed here, even if the device was closed
+// meanwhile: only process context frees it.
+static void stop_transmission(struct morse_dev *dev)
+{
+	dev->is_transmitting = 0;
+	dev->current_element = MORSE_ELEMENT_NONE;
+	wake_up(&dev->drain_queue);
+	MOD_DEC_USE_COUNT;
+}
+
+static unsigned long element_duration(struct morse_dev *dev, int element)
+{
+	switch (element)
+	{
+	case MORSE_ELEMENT_DOT:
+		return dev->dot_duration;
+	case MORSE_ELEMENT_DASH:
+		return dev->dash_duration;
+	case MORSE_ELEMENT_SYMBOL_PAUSE:
+		return dev->symbol_pause;
+	case MORSE_ELEMENT_LETTER_PAUSE:
+		return dev->letter_pause;
+	case MORSE_ELEMENT_WORD_PAUSE:
+		return dev->word_pause;
+	case MORSE_ELEMENT_BEACON_GAP:
+		return dev->word_pause + dev->beacon_gap;
+	}
+	return 0;
+}
+
+// Starts element and arms the timer for its end.
+// Elements are scheduled against the previous deadline rather than the
+// time the timer actually ran, and the part of a duration that does not
+// fit in whole jiffies is carried into the next element, so rounding and
+// timer latency never accumulate over a long message.
+static void schedule_element(struct morse_dev *dev, int element)
+{
+	long total = element_duration(dev, element) + dev->timing_error;
+	long ticks = 1;
+
+	dev->current_element = element;
+	if (total >= (1 << JIFFY_SHIFT))
+		ticks = total >> JIFFY_SHIFT;
+
+	// Elements shorter than a jiffy borrow from the following ones, but
+	// never more than a jiffy's worth
+	dev->timing_error = total - (ticks << JIFFY_SHIFT);
+	if (dev->timing_error < -(1 << JIFFY_SHIFT))
+		dev->timing_error = -(1 << JIFFY_SHIFT);
+
+	dev->deadline += ticks;
+	if ((long)(dev->deadline - jiffies) <= 0)
+	{
+		// Too late to catch up, start a fresh schedule
+		dev->timer_overruns++;
+		dev->deadline = jiffies + 1;
+		dev->timing_error = 0;
 	}
 
-	signal_state[minor] = state;
+	dev->timer.expires = dev->deadline;
+	add_timer(&dev->timer);
 }
 
+// Called before the timer takes a byte from source. Anything else
+// interrupting the beacon makes it start over once it resumes, and
+// drains complete as soon as only the beacon is left.
+static void set_source(struct morse_dev *dev, int source)
+{
+	if (source != SOURCE_BEACON)
+		dev->beacon_pos = 0;
+	else if (dev->current_source != SOURCE_BEACON)
+		wake_up(&dev->drain_queue);
+	dev->current_source = source;
+}
+
+// Runs in timer context: it must never sleep, so it only touches the
+// consumer side of the buffer. Process context code that inspects
+// is_transmitting or device_in_use does so with interrupts disabled.
+//
+// Gaps are exact: symbol_pause separates the elements of a character,
+// letter_pause separates characters and word_pause replaces the letter
+// pause before a space, even with unsupported bytes in between. An
+// urgent message is also kept apart from the text it interrupts by word
+// pauses, and a word pause lengthened by beacon_gap replaces the letter
+// pause between two repeats of the beacon.
 void morse_timer_function(unsigned long data)
 {
-	int minor = (int)data;
+	struct morse_dev *dev = (struct morse_dev *)data;
+	int source;
 
-	if (current_code[minor] == NULL)
+	if (dev->signal_state)
 	{
-		down(&sem[minor]);
-		if (buffer_count[minor] > 0)
+		set_signal(dev, 0);
+
+		if (dev->current_code != 1)
 		{
-			current_char[minor] = buffer[minor][buffer_tail[minor]];
-			buffer_tail[minor] = (buffer_tail[minor] + 1) % buffer_size[minor];
-			buffer_count[minor]--;
-			up(&sem[minor]);
+			schedule_element(dev, MORSE_ELEMENT_SYMBOL_PAUSE);
+			return;
+		}
 
-			wake_up(&write_queue[minor]);
+		dev->current_code = 0;
+		source = next_source(dev);
 
-			if (current_char[minor] >= 'A' && current_char[minor] <= 'Z')
-			{
-				current_code[minor] = morse_codes[current_char[minor] - 'A'];
-			}
-			else if (current_char[minor] >= 'a' && current_char[minor] <= 'z')
-			{
-				current_code[minor] = morse_codes[current_char[minor] - 'a'];
-			}
-			else if (current_char[minor] >= '0' && current_char[minor] <= '9')
-			{
-				current_code[minor] = morse_digits[current_char[minor] - '0'];
-			}
-			else if (current_char[minor] == ' ')
-			{
-				// Word pause
-				set_signal(minor, 0);
-				morse_timer[minor].expires = jiffies + (word_pause[minor] * HZ / 1000);
-				add_timer(&morse_timer[minor]);
-				return;
-			}
+		// Bytes that have no code are dropped before looking ahead,
+		// so that they cannot hide a space
+		while (source != SOURCE_NONE && morse_table[(unsigned char)source_peek(dev, source)] == 0)
+		{
+			source_get(dev, source);
+			dev->chars_skipped++;
+			source = next_source(dev);
+		}
 
-			code_position[minor] = 0;
-			morse_timer[minor].expires = jiffies + 1;
+		if (source != SOURCE_NONE &&
+		    morse_table[(unsigned char)source_peek(dev, source)] == CODE_SPACE)
+		{
+			set_source(dev, source);
+			dev->current_char = source_get(dev, source);
+			dev->chars_sent++;
+			schedule_element(dev, MORSE_ELEMENT_WORD_PAUSE);
+		}
+		else if (source == SOURCE_BEACON && dev->current_source == SOURCE_BEACON &&
+			 dev->beacon_pos == 0)
+		{
+			schedule_element(dev, MORSE_ELEMENT_BEACON_GAP);
+		}
+		else if (source != SOURCE_NONE && source != dev->current_source)
+		{
+			schedule_element(dev, MORSE_ELEMENT_WORD_PAUSE);
 		}
 		else
 		{
-			is_transmitting[minor] = 0;
-			set_signal(minor, 0);
-			if (device_in_use[minor] == 0)
-			{
-				kfree(buffer[minor]);
-				MOD_DEC_USE_COUNT;
-			}
-			up(&sem[minor]);
-			return;
+			schedule_element(dev, MORSE_ELEMENT_LETTER_PAUSE);
 		}
+		return;
 	}
-	else
+
+	while (dev->current_code == 0)
 	{
-		if (signal_state[minor])
+		source = next_source(dev);
+		if (source == SOURCE_NONE)
 		{
-			// Signal was on, symbol pause
-			set_signal(minor, 0);
-			morse_timer[minor].expires = jiffies + (symbol_pause[minor] * HZ / 1000);
+			stop_transmission(dev);
+			return;
 		}
-		else
+		set_source(dev, source);
+		dev->current_char = source_get(dev, source);
+
+		// Unsupported characters are skipped
+		dev->current_code = morse_table[(unsigned char)dev->current_char];
+		if (dev->current_code == 0)
 		{
-			// Signal was off
-			if (current_code[minor][code_position[minor]] == '\0')
-			{
-				// Letter pause
-				morse_timer[minor].expires = jiffies + (letter_pause[minor] * HZ / 1000);
-				current_code[minor] = NULL;
-			}
-			else if (current_code[minor][code_position[minor]] == '.')
-			{
-				// Send a dot
-				set_signal(minor, 1);
-				morse_timer[minor].expires = jiffies + (dot_duration[minor] * HZ / 1000);
-				code_position[minor]++;
-			}
-			else
-			{
-				// Send a dash
-				set_signal(minor, 1);
-				morse_timer[minor].expires = jiffies + (dash_duration[minor] * HZ / 1000);
-				code_position[minor]++;
-			}
+			dev->chars_skipped++;
+			continue;
+		}
+		dev->chars_sent++;
+		if (dev->current_code == CODE_SPACE)
+		{
+			dev->current_code = 0;
+			schedule_element(dev, MORSE_ELEMENT_WORD_PAUSE);
+			return;
 		}
 	}
 
-	add_timer(&morse_timer[minor]);
-	return;
+	set_signal(dev, 1);
+	if (dev->current_code & DAH)
+		schedule_element(dev, MORSE_ELEMENT_DASH);
+	else
+		schedule_element(dev, MORSE_ELEMENT_DOT);
+	dev->current_code >>= 1;
 }
 
+extern struct file_operations decoder_ops;
+
 int morse_open(struct inode *inode, struct file *file)
 {
 	int minor = get_minor(inode);
+	struct morse_dev *dev;
+	unsigned long flags;
+	int need_buffer, first_open;
+
+	if (MINOR(inode->i_rdev) >= DECODER_MINOR)
+	{
+		file->f_op = &decoder_ops;
+		return decoder_ops.open(inode, file);
+	}
+
 	if (minor < 0)
 	{
 		return minor;
 	}
+	dev = morse_devs[minor];
+
+	down(&dev->sem);
 
-	down(&sem[minor]);
+	save_flags(flags);
+	cli();
+	first_open = dev->device_in_use++ == 0;
+	need_buffer = dev->buffer == NULL;
+	if (first_open && !dev->is_transmitting)
+	{
+		// Nothing from before the device was last left idle is
+		// read back
+		dev->event_out = dev->event_in;
+		dev->signal_state = 0;
+	}
+	restore_flags(flags);
 
-	device_in_use[minor]++;
 	MOD_INC_USE_COUNT;
-	if (device_in_use[minor] == 1 && !is_transmitting[minor])
+	if (need_buffer)
 	{
-		buffer[minor] = kmalloc(DEFAULT_BUFFER_SIZE, GFP_KERNEL);
-		if (buffer[minor] == NULL)
+		// The timer only looks at the buffer while bytes are counted
+		// in it, so it cannot see this one yet
+		dev->buffer = kmalloc(dev->buffer_size, GFP_KERNEL);
+		if (dev->buffer == NULL)
 		{
-			device_in_use[minor]--;
+			dev->device_in_use--;
 			MOD_DEC_USE_COUNT;
-			up(&sem[minor]);
+			up(&dev->sem);
 			return -ENOMEM;
 		}
 
-		buffer_count[minor] = 0;
-		buffer_head[minor] = 0;
-		buffer_tail[minor] = 0;
-
-		is_transmitting[minor] = 0;
-		signal_state[minor] = 0;
+		// A ring attached to the device may still be feeding the
+		// timer, so its side is reset with interrupts disabled
+		save_flags(flags);
+		cli();
+		dev->buffer_head = 0;
+		dev->buffer_tail = 0;
+		dev->buffer_in = 0;
+		dev->buffer_out = 0;
+		restore_flags(flags);
 	}
 
-	up(&sem[minor]);
+	up(&dev->sem);
 
 	return 0;
 }
@@ -265,183 +837,848 @@ int morse_open(struct inode *inode, struct file *file)
 void morse_release(struct inode *inode, struct file *file)
 {
 	int minor = get_minor(inode);
+	struct morse_dev *dev;
+	unsigned long flags;
+	char *old_buffer = NULL;
+
 	if (minor < 0)
 	{
 		return;
 	}
+	dev = morse_devs[minor];
 
-	down(&sem[minor]);
-	device_in_use[minor]--;
-	if (device_in_use[minor] == 0 && !is_transmitting[minor])
+	down(&dev->sem);
+	save_flags(flags);
+	cli();
+	dev->device_in_use--;
+	if (dev->device_in_use == 0 && !dev->is_transmitting)
 	{
-		// Only free the buffer if not transmitting and no more users
-		kfree(buffer[minor]);
-		MOD_DEC_USE_COUNT;
+		// Otherwise the timer may still be reading it: it is kept
+		// for the next open, or until the module is unloaded
+		old_buffer = dev->buffer;
+		dev->buffer = NULL;
 	}
-	up(&sem[minor]);
+	restore_flags(flags);
+	up(&dev->sem);
+
+	if (old_buffer != NULL)
+		kfree(old_buffer);
+	MOD_DEC_USE_COUNT;
 }
 
 int morse_write(struct inode *inode, struct file *file, const char *buf, int count)
 {
 	int minor = get_minor(inode);
-	int i, bytes_written = 0;
-	char ch;
+	struct morse_dev *dev;
+	unsigned long flags;
+	int i = 0;
 
 	if (minor < 0)
 	{
 		return minor;
 	}
+	dev = morse_devs[minor];
 
-	for (i = 0; i < count; i++)
+	while (i < count)
 	{
-		ch = get_user(buf + i);
-		while (buffer_count[minor] == buffer_size[minor])
+		down(&dev->sem);
+		while (i < count && buffer_count(dev) < dev->buffer_size)
 		{
-			interruptible_sleep_on(&write_queue[minor]);
-			if (current->signal & ~current->blocked)
+			buffer_put(dev, get_user(buf + i));
+			i++;
+		}
+		up(&dev->sem);
+
+		// Checking for room and going to sleep must be atomic with
+		// respect to the timer, or its wake_up() could be lost.
+		save_flags(flags);
+		cli();
+		start_transmission(dev);
+		if (i < count && buffer_count(dev) == dev->buffer_size)
+		{
+			if (file->f_flags & O_NONBLOCK)
 			{
+				restore_flags(flags);
 				if (i == 0)
-					return -ERESTARTSYS;
+					return -EAGAIN;
 				return i;
 			}
+			dev->writer_sleeps++;
+			interruptible_sleep_on(&dev->write_queue);
 		}
+		restore_flags(flags);
 
-		down(&sem[minor]);
-		buffer[minor][buffer_head[minor]] = ch;
-		buffer_head[minor] = (buffer_head[minor] + 1) % buffer_size[minor];
-		buffer_count[minor]++;
-		bytes_written++;
-		up(&sem[minor]);
+		if (i < count && (current->signal & ~current->blocked))
+		{
+			if (i == 0)
+				return -ERESTARTSYS;
+			return i;
+		}
 	}
 
-	down(&sem[minor]);
+	return count;
+}
+
+// Copies logged events out to user space, oldest first
+static int read_events(struct morse_dev *dev, struct morse_event_log *log)
+{
+	int i, err;
+
+	if (log->count < 0)
+		return -EINVAL;
+	if ((err = verify_area(VERIFY_WRITE, log->events, log->count * sizeof(struct morse_event))) < 0)
+		return err;
 
-	if (!is_transmitting[minor] && buffer_count[minor] > 0)
+	for (i = 0; i < log->count && dev->event_out != dev->event_in; i++)
 	{
-		is_transmitting[minor] = 1;
-		morse_timer[i].expires = jiffies + 1;
-		add_timer(&morse_timer[minor]);
+		memcpy_tofs(&log->events[i],
+			    &dev->event_log[dev->event_out & (EVENT_LOG_SIZE - 1)],
+			    sizeof(struct morse_event));
+		barrier(); // the event must be copied before its slot is released
+		dev->event_out++;
 	}
 
-	up(&sem[minor]);
-
-	return bytes_written;
+	return i;
 }
 
-int morse_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg)
+// Returns whole struct morse_event records, oldest first, sleeping
+// until there is at least one
+int morse_read(struct inode *inode, struct file *file, char *buf, int count)
 {
 	int minor = get_minor(inode);
-	int value, err;
-	char *new_buffer;
-	int i, old_size, new_size;
+	struct morse_dev *dev;
+	struct morse_event_log log;
+	unsigned long flags;
+	int n;
 
 	if (minor < 0)
 	{
 		return minor;
 	}
+	dev = morse_devs[minor];
 
-	if (_IOC_DIR(cmd) & _IOC_READ)
-	{
-		int len = _IOC_SIZE(cmd);
-		if ((err = verify_area(VERIFY_WRITE, (void *)arg, len)) < 0)
-			return err;
-	}
+	if (count < sizeof(struct morse_event))
+		return -EINVAL;
+	log.count = count / sizeof(struct morse_event);
+	log.events = (struct morse_event *)buf;
 
-	switch (cmd)
+	for (;;)
 	{
-	case MORSE_IOC_SET_DOT_DURATION:
-		value = (int)arg;
-		if (value <= 0)
+		down(&dev->sem);
+		n = read_events(dev, &log);
+		up(&dev->sem);
+		if (n < 0)
+			return n;
+		if (n > 0)
+			return n * sizeof(struct morse_event);
+
+		// As in morse_write(), so that the timer's wake_up() is not lost
+		save_flags(flags);
+		cli();
+		if (dev->event_in == dev->event_out)
 		{
-			return -EINVAL;
+			if (file->f_flags & O_NONBLOCK)
+			{
+				restore_flags(flags);
+				return -EAGAIN;
+			}
+			interruptible_sleep_on(&dev->read_queue);
 		}
-		dot_duration[minor] = value;
-		break;
+		restore_flags(flags);
 
-	case MORSE_IOC_SET_DASH_DURATION:
-		value = (int)arg;
-		if (value <= 0)
-		{
-			return -EINVAL;
-		}
-		dash_duration[minor] = value;
-		break;
+		if (current->signal & ~current->blocked)
+			return -ERESTARTSYS;
+	}
+}
 
-	case MORSE_IOC_SET_SYMBOL_PAUSE:
-		value = (int)arg;
-		if (value <= 0)
-		{
-			return -EINVAL;
-		}
-		symbol_pause[minor] = value;
-		break;
+int morse_select(struct inode *inode, struct file *file, int sel_type, select_table *wait)
+{
+	int minor = get_minor(inode);
+	struct morse_dev *dev;
 
-	case MORSE_IOC_SET_LETTER_PAUSE:
-		value = (int)arg;
-		if (value <= 0)
-		{
-			return -EINVAL;
-		}
-		letter_pause[minor] = value;
-		break;
+	if (minor < 0)
+	{
+		return 0;
+	}
+	dev = morse_devs[minor];
 
-	case MORSE_IOC_SET_WORD_PAUSE:
-		value = (int)arg;
-		if (value <= 0)
-		{
-			return -EINVAL;
-		}
-		word_pause[minor] = value;
-		break;
+	switch (sel_type)
+	{
+	case SEL_IN:
+		if (dev->event_in != dev->event_out)
+			return 1;
+		select_wait(&dev->read_queue, wait);
+		return 0;
+
+	case SEL_OUT:
+		if (buffer_count(dev) < dev->buffer_size)
+			return 1;
+		select_wait(&dev->write_queue, wait);
+		return 0;
+	}
+	return 0;
+}
 
-	case MORSE_IOC_SET_BUFFER_SIZE:
-		new_size = (int)arg;
-		if (new_size < MIN_BUFFER_SIZE || new_size > MAX_BUFFER_SIZE)
-		{
-			return -EINVAL;
-		}
+// Waits until everything queued so far has been transmitted. A beacon
+// repeats forever, so it does not count.
+static int morse_drain(struct morse_dev *dev, struct file *file)
+{
+	unsigned long flags;
 
-		if (new_size == buffer_size[minor])
+	save_flags(flags);
+	cli();
+	while (drain_pending(dev))
+	{
+		if (file->f_flags & O_NONBLOCK)
 		{
-			return 0;
+			restore_flags(flags);
+			return -EAGAIN;
 		}
 
-		down(&sem[minor]);
-		if (new_size < buffer_count[minor])
+		interruptible_sleep_on(&dev->drain_queue);
+		if (current->signal & ~current->blocked)
 		{
-			up(&sem[minor]);
-			return -EBUSY;
+			restore_flags(flags);
+			return -ERESTARTSYS;
 		}
+	}
+	restore_flags(flags);
 
-		new_buffer = kmalloc(new_size, GFP_KERNEL);
-		if (new_buffer == NULL)
+	return 0;
+}
+
+int morse_fsync(struct inode *inode, struct file *file)
+{
+	int minor = get_minor(inode);
+	if (minor < 0)
+	{
+		return minor;
+	}
+
+	return morse_drain(morse_devs[minor], file);
+}
+
+// Sets all five durations at once from a character speed and an optional
+// slower Farnsworth speed, which only stretches the letter and word gaps.
+// The timer never sees a half-updated configuration.
+static int set_speed(struct morse_dev *dev, struct morse_speed *speed)
+{
+	unsigned long unit, spacing;
+	unsigned long c = speed->wpm, s = speed->farnsworth_wpm;
+	unsigned long flags;
+
+	if (speed->wpm < 1 || speed->wpm > MAX_WPM)
+		return -EINVAL;
+	if (speed->farnsworth_wpm < 0 || speed->farnsworth_wpm > speed->wpm)
+		return -EINVAL;
+
+	// One element is 1.2 s / wpm (the word PARIS is 50 elements long)
+	unit = usecs_to_ticks(1200000 / c);
+
+	// Farnsworth: the 19 units of gaps in PARIS absorb the time saved by
+	// sending its 31 units of characters at c instead of s wpm, which
+	// gives (60 c - 37.2 s) / (19 s c) seconds per gap unit
+	spacing = unit;
+	if (s != 0 && s != c)
+		spacing = usecs_to_ticks((600 * c - 372 * s) * 10000 / (19 * s * c) * 10);
+
+	save_flags(flags);
+	cli();
+	dev->dot_duration = unit;
+	dev->dash_duration = 3 * unit;
+	dev->symbol_pause = unit;
+	dev->letter_pause = 3 * spacing;
+	dev->word_pause = 7 * spacing;
+	restore_flags(flags);
+
+	return 0;
+}
+
+static int set_output(struct morse_dev *dev, int type)
+{
+	unsigned long flags;
+
+	if (type < 0 || type >= OUTPUTS_COUNT)
+		return -EINVAL;
+
+	// Hand the current state over, so that no output is left switched on
+	save_flags(flags);
+	cli();
+	outputs[dev->output_type].set(dev, 0);
+	dev->output_type = type;
+	if (dev->signal_state)
+		outputs[type].set(dev, 1);
+	restore_flags(flags);
+
+	return 0;
+}
+
+static int set_screen(struct morse_dev *dev, struct morse_screen *config)
+{
+	unsigned long flags;
+
+	if (config->console < -1 || config->console >= MAX_NR_CONSOLES)
+		return -EINVAL;
+	if (config->row < 0 || config->row >= video_num_lines)
+		return -EINVAL;
+	if (config->column < 0 || config->column >= video_num_columns)
+		return -EINVAL;
+	if (config->colour < 0 || config->colour > 0xff)
+		return -EINVAL;
+
+	save_flags(flags);
+	cli();
+	if (dev->output_type == MORSE_OUTPUT_SCREEN)
+		screen_output(dev, 0);
+	dev->screen_config = *config;
+	if (dev->output_type == MORSE_OUTPUT_SCREEN)
+		screen_output(dev, dev->signal_state);
+	restore_flags(flags);
+
+	return 0;
+}
+
+// Discards everything queued and stops the current character at once.
+// The beacon is kept, and starts over.
+static void flush_device(struct morse_dev *dev)
+{
+	unsigned long flags;
+
+	down(&dev->sem);
+
+	// With interrupts disabled the timer cannot run, so its side of the
+	// queues can be reset from here too
+	save_flags(flags);
+	cli();
+	dev->buffer_out = dev->buffer_in;
+	dev->buffer_tail = dev->buffer_head;
+	dev->urgent_out = dev->urgent_in;
+	if (dev->is_transmitting)
+	{
+		del_timer(&dev->timer);
+		dev->current_code = 0;
+		if (dev->signal_state)
+			set_signal(dev, 0);
+		stop_transmission(dev);
+	}
+	dev->beacon_pos = 0;
+	start_transmission(dev);
+	restore_flags(flags);
+
+	up(&dev->sem);
+	wake_up(&dev->write_queue);
+}
+
+// Queues a message ahead of the buffer. The whole message is published
+// at once, so the timer never starts on half of it.
+static int send_urgent(struct morse_dev *dev, struct morse_message *message)
+{
+	unsigned long flags;
+	int i, err;
+
+	if (message->length <= 0)
+		return -EINVAL;
+	if (message->length > URGENT_SIZE)
+		return -EMSGSIZE;
+	if ((err = verify_area(VERIFY_READ, message->text, message->length)) < 0)
+		return err;
+
+	down(&dev->sem);
+	if (URGENT_SIZE - urgent_count(dev) < message->length)
+	{
+		up(&dev->sem);
+		return -EAGAIN;
+	}
+
+	for (i = 0; i < message->length; i++)
+		dev->urgent[(dev->urgent_in + i) & (URGENT_SIZE - 1)] = get_user(message->text + i);
+	barrier();
+	dev->urgent_in += message->length;
+	up(&dev->sem);
+
+	save_flags(flags);
+	cli();
+	start_transmission(dev);
+	restore_flags(flags);
+
+	return 0;
+}
+
+// How long the elements left in code take, with the symbol pauses
+// between them
+static unsigned long code_duration(struct morse_dev *dev, unsigned short code)
+{
+	unsigned long duration = 0;
+
+	for (; code != 1; code >>= 1)
+	{
+		duration += element_duration(dev, code & DAH ? MORSE_ELEMENT_DASH : MORSE_ELEMENT_DOT);
+		if (code >> 1 != 1)
+			duration += dev->symbol_pause;
+	}
+	return duration;
+}
+
+// How long a queued byte from source takes to send, with the pause in
+// front of it chosen as the timer does. last is the source of the letter
+// sent just before, or SOURCE_NONE if a word pause follows it anyway:
+// the letter pause only separates letters from the same source, and a
+// space always stands for a whole word pause. Bytes that have no code
+// take no time and leave last alone, as the timer skips them.
+static unsigned long byte_duration(struct morse_dev *dev, int *last, int source, unsigned char ch)
+{
+	unsigned short code = morse_table[ch];
+	unsigned long duration = 0;
+
+	if (code == 0)
+		return 0;
+	if (code == CODE_SPACE)
+	{
+		*last = SOURCE_NONE;
+		return dev->word_pause;
+	}
+
+	if (*last == source)
+		duration = dev->letter_pause;
+	else if (*last != SOURCE_NONE)
+		duration = dev->word_pause;
+	*last = source;
+	return duration + code_duration(dev, code);
+}
+
+// Fills in status. With sem held nothing can be queued, so once the
+// timer's position has been read the queued bytes stay put even while
+// it goes on consuming them, and the estimate can be made without
+// keeping interrupts disabled. The bytes are summed in the order the
+// timer takes them. An attached ring is not covered by sem: its writers
+// and the timer carry on while its bytes are summed, so that part is a
+// close estimate rather than a snapshot.
+static void get_status(struct morse_dev *dev, struct morse_status *status)
+{
+	unsigned long flags;
+	unsigned long left, ticks = 0, eta = 0;
+	unsigned int in, out, tail, urgent_first, urgent_last;
+	unsigned short code;
+	int i, count, last = SOURCE_NONE;
+
+	down(&dev->sem);
+
+	save_flags(flags);
+	cli();
+	status->transmitting = dev->is_transmitting;
+	status->element = dev->current_element;
+	status->current_char = dev->is_transmitting ? (unsigned char)dev->current_char : -1;
+	status->chars_sent = dev->chars_sent;
+	status->chars_skipped = dev->chars_skipped;
+	status->writer_sleeps = dev->writer_sleeps;
+	status->timer_overruns = dev->timer_overruns;
+	status->events_lost = dev->events_lost;
+
+	in = dev->buffer_in;
+	out = dev->buffer_out;
+	tail = dev->buffer_tail;
+	urgent_first = dev->urgent_out;
+	urgent_last = dev->urgent_in;
+
+	// The rest of the current element and character. Until its last
+	// element is over, the pause after the character is still to be
+	// chosen.
+	left = 0;
+	code = dev->current_code;
+	if (dev->is_transmitting)
+	{
+		// The timer may not have run yet although the deadline
+		// has passed
+		if ((long)(dev->deadline - jiffies) > 0)
+			left = dev->deadline - jiffies;
+		if (dev->signal_state && code != 1)
+			ticks = dev->symbol_pause + code_duration(dev, code);
+		else if (dev->current_element == MORSE_ELEMENT_SYMBOL_PAUSE)
+			ticks = code_duration(dev, code);
+		if (dev->signal_state || dev->current_element == MORSE_ELEMENT_SYMBOL_PAUSE)
+			last = dev->current_source;
+	}
+	restore_flags(flags);
+
+	count = in - out;
+	status->queued = count + (urgent_last - urgent_first);
+
+	// Summed a byte at a time, carrying whole jiffies out as it goes
+	for (; urgent_first != urgent_last; urgent_first++)
+	{
+		ticks += byte_duration(dev, &last, SOURCE_URGENT,
+				       dev->urgent[urgent_first & (URGENT_SIZE - 1)]);
+		eta += ticks >> JIFFY_SHIFT;
+		ticks &= (1 << JIFFY_SHIFT) - 1;
+	}
+	for (i = 0; i < count; i++)
+	{
+		ticks += byte_duration(dev, &last, SOURCE_BUFFER, dev->buffer[tail]);
+		if (++tail == dev->buffer_size)
+			tail = 0;
+		eta += ticks >> JIFFY_SHIFT;
+		ticks &= (1 << JIFFY_SHIFT) - 1;
+	}
+#ifdef MORSE_RING_FEED
+	if (dev->ring_minor >= 0)
+	{
+		int ch;
+
+		count = ring_count(dev->ring_minor);
+		status->queued += count;
+		for (i = 0; i < count && (ch = ring_peek_at(dev->ring_minor, i)) >= 0; i++)
+		{
+			ticks += byte_duration(dev, &last, SOURCE_RING, ch);
+			eta += ticks >> JIFFY_SHIFT;
+			ticks &= (1 << JIFFY_SHIFT) - 1;
+		}
+	}
+#endif
+
+	// The pause after the last letter, before the beacon takes over
+	// with a word pause or the transmission ends
+	if (last != SOURCE_NONE && last != SOURCE_BEACON)
+		ticks += dev->beacon_length > 0 ? dev->word_pause : dev->letter_pause;
+
+	up(&dev->sem);
+
+	eta += left + (ticks >> JIFFY_SHIFT);
+	status->eta = eta / HZ * 1000 + eta % HZ * 1000 / HZ;
+}
+
+// /proc/morse: one line per device. With many devices the table is
+// longer than a page, so only the lines around offset are formatted.
+static int morse_get_info(char *buf, char **start, off_t offset, int length, int unused)
+{
+	struct morse_status status;
+	int minor, len;
+	off_t begin = 0, end;
+
+	len = sprintf(buf, "minor tx queued char element eta_ms sent skipped sleeps overruns lost\n");
+	for (minor = 0; minor < devices; minor++)
+	{
+		get_status(morse_devs[minor], &status);
+		len += sprintf(buf + len, "%5d %2d %6d %4d %7d %6lu %4lu %7lu %6lu %8lu %4lu\n",
+			       minor, status.transmitting, status.queued,
+			       status.current_char, status.element, status.eta,
+			       status.chars_sent, status.chars_skipped,
+			       status.writer_sleeps, status.timer_overruns,
+			       status.events_lost);
+		end = begin + len;
+		if (end < offset)
+		{
+			len = 0;
+			begin = end;
+		}
+		if (end > offset + length)
+			break;
+	}
+
+	if (offset >= begin + len)
+		return 0;
+	*start = buf + (offset - begin);
+	len -= offset - begin;
+	if (len > length)
+		len = length;
+	return len;
+}
+
+static struct proc_dir_entry proc_morse = {
+	namelen : 5,
+	name : "morse",
+	mode : S_IFREG | S_IRUGO,
+	nlink : 1,
+	get_info : morse_get_info
+};
+
+// Replaces the beacon. Bytes that have no code are dropped here rather
+// than on every repeat, and so are spaces at either end.
+static int set_beacon(struct morse_dev *dev, struct morse_beacon *config)
+{
+	char text[BEACON_SIZE];
+	unsigned long flags;
+	int i, length = 0, err;
+
+	if (config->length < 0 || config->gap < 0 || config->gap > MAX_DURATION)
+		return -EINVAL;
+	if (config->length > BEACON_SIZE)
+		return -EMSGSIZE;
+	if ((err = verify_area(VERIFY_READ, config->text, config->length)) < 0)
+		return err;
+
+	for (i = 0; i < config->length; i++)
+	{
+		text[length] = get_user(config->text + i);
+		if (morse_table[(unsigned char)text[length]] == 0)
+			continue;
+		if (morse_table[(unsigned char)text[length]] == CODE_SPACE && length == 0)
+			continue;
+		length++;
+	}
+	while (length > 0 && morse_table[(unsigned char)text[length - 1]] == CODE_SPACE)
+		length--;
+	if (length == 0 && config->length > 0)
+		return -EINVAL;
+
+	down(&dev->sem);
+	save_flags(flags);
+	cli();
+	memcpy(dev->beacon, text, length);
+	dev->beacon_length = length;
+	dev->beacon_pos = 0;
+	dev->beacon_gap = msecs_to_ticks(config->gap);
+	start_transmission(dev);
+	restore_flags(flags);
+	up(&dev->sem);
+
+	// Drains were only waiting for the beacon if it was just cleared
+	wake_up(&dev->drain_queue);
+	return 0;
+}
+
+#ifdef MORSE_RING_FEED
+// Called by the ring module after every byte written to the attached
+// minor, from the writer's process context
+static void ring_notify(unsigned long data)
+{
+	struct morse_dev *dev = (struct morse_dev *)data;
+	unsigned long flags;
+
+	save_flags(flags);
+	cli();
+	start_transmission(dev);
+	restore_flags(flags);
+}
+
+// Makes a ring minor an input of the device, after the buffer and before
+// the beacon. The device stays attached after it is closed, like its
+// transmission goes on; -1 detaches it.
+static int attach_ring(struct morse_dev *dev, int ring_minor)
+{
+	unsigned long flags;
+	int old, err;
+
+	if (ring_minor < -1)
+		return -EINVAL;
+
+	down(&dev->sem);
+	old = dev->ring_minor;
+	if (ring_minor == old)
+	{
+		up(&dev->sem);
+		return 0;
+	}
+	if (ring_minor >= 0 && (err = ring_attach(ring_minor, ring_notify, (unsigned long)dev)) < 0)
+	{
+		up(&dev->sem);
+		return err;
+	}
+
+	// The timer must be done with the old ring before it is let go
+	save_flags(flags);
+	cli();
+	dev->ring_minor = ring_minor;
+	start_transmission(dev);
+	restore_flags(flags);
+
+	if (old >= 0)
+		ring_detach(old);
+	up(&dev->sem);
+
+	// Drains were only waiting for the old ring if it was just detached
+	wake_up(&dev->drain_queue);
+	return 0;
+}
+#endif
+
+int morse_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg)
+{
+	int minor = get_minor(inode);
+	struct morse_dev *dev;
+	int value, err;
+	char *new_buffer, *old_buffer;
+	int i, count, old_size, new_size;
+	unsigned long flags;
+	struct morse_speed speed;
+	struct morse_screen screen;
+	struct morse_event_log log;
+	struct morse_message message;
+	struct morse_status status;
+	struct morse_beacon beacon_config;
+
+	if (minor < 0)
+	{
+		return minor;
+	}
+	dev = morse_devs[minor];
+
+	if (_IOC_DIR(cmd) & _IOC_READ)
+	{
+		int len = _IOC_SIZE(cmd);
+		if ((err = verify_area(VERIFY_WRITE, (void *)arg, len)) < 0)
+			return err;
+	}
+
+	switch (cmd)
+	{
+	case MORSE_IOC_SET_DOT_DURATION:
+		value = (int)arg;
+		if (value <= 0 || value > MAX_DURATION)
+		{
+			return -EINVAL;
+		}
+		dev->dot_duration = msecs_to_ticks(value);
+		break;
+
+	case MORSE_IOC_SET_DASH_DURATION:
+		value = (int)arg;
+		if (value <= 0 || value > MAX_DURATION)
+		{
+			return -EINVAL;
+		}
+		dev->dash_duration = msecs_to_ticks(value);
+		break;
+
+	case MORSE_IOC_SET_SYMBOL_PAUSE:
+		value = (int)arg;
+		if (value <= 0 || value > MAX_DURATION)
+		{
+			return -EINVAL;
+		}
+		dev->symbol_pause = msecs_to_ticks(value);
+		break;
+
+	case MORSE_IOC_SET_LETTER_PAUSE:
+		value = (int)arg;
+		if (value <= 0 || value > MAX_DURATION)
+		{
+			return -EINVAL;
+		}
+		dev->letter_pause = msecs_to_ticks(value);
+		break;
+
+	case MORSE_IOC_SET_WORD_PAUSE:
+		value = (int)arg;
+		if (value <= 0 || value > MAX_DURATION)
+		{
+			return -EINVAL;
+		}
+		dev->word_pause = msecs_to_ticks(value);
+		break;
+
+	case MORSE_IOC_SET_SPEED:
+		if ((err = verify_area(VERIFY_READ, (void *)arg, sizeof(struct morse_speed))) < 0)
+			return err;
+		memcpy_fromfs(&speed, (void *)arg, sizeof(struct morse_speed));
+		return set_speed(dev, &speed);
+
+	case MORSE_IOC_SET_OUTPUT:
+		return set_output(dev, (int)arg);
+
+	case MORSE_IOC_SET_SCREEN:
+		if ((err = verify_area(VERIFY_READ, (void *)arg, sizeof(struct morse_screen))) < 0)
+			return err;
+		memcpy_fromfs(&screen, (void *)arg, sizeof(struct morse_screen));
+		return set_screen(dev, &screen);
+
+	case MORSE_IOC_READ_EVENTS:
+		if ((err = verify_area(VERIFY_READ, (void *)arg, sizeof(struct morse_event_log))) < 0)
+			return err;
+		memcpy_fromfs(&log, (void *)arg, sizeof(struct morse_event_log));
+		down(&dev->sem);
+		value = read_events(dev, &log);
+		up(&dev->sem);
+		if (value < 0)
+			return value;
+		put_user(value, &((struct morse_event_log *)arg)->count);
+		break;
+
+	case MORSE_IOC_FLUSH:
+		flush_device(dev);
+		break;
+
+	case MORSE_IOC_URGENT:
+		if ((err = verify_area(VERIFY_READ, (void *)arg, sizeof(struct morse_message))) < 0)
+			return err;
+		memcpy_fromfs(&message, (void *)arg, sizeof(struct morse_message));
+		return send_urgent(dev, &message);
+
+	case MORSE_IOC_SET_BUFFER_SIZE:
+		new_size = (int)arg;
+		if (new_size < MIN_BUFFER_SIZE || new_size > MAX_BUFFER_SIZE)
+		{
+			return -EINVAL;
+		}
+
+		if (new_size == dev->buffer_size)
+		{
+			return 0;
+		}
+
+		new_buffer = kmalloc(new_size, GFP_KERNEL);
+		if (new_buffer == NULL)
 		{
-			up(&sem[minor]);
 			return -ENOMEM;
 		}
 
-		old_size = buffer_size[minor];
-		for (i = 0; i < buffer_count[minor]; i++)
+		down(&dev->sem);
+
+		// The timer keeps consuming while we copy, so the swap is done
+		// with interrupts disabled.
+		save_flags(flags);
+		cli();
+		count = buffer_count(dev);
+		if (new_size < count)
 		{
-			new_buffer[i] = buffer[minor][(buffer_tail[minor] + i) % old_size];
+			restore_flags(flags);
+			up(&dev->sem);
+			kfree(new_buffer);
+			return -EBUSY;
 		}
 
-		kfree(buffer[minor]);
-		buffer[minor] = new_buffer;
-		buffer_size[minor] = new_size;
-		buffer_head[minor] = buffer_count[minor] % new_size;
-		buffer_tail[minor] = 0;
-		up(&sem[minor]);
+		old_size = dev->buffer_size;
+		for (i = 0; i < count; i++)
+		{
+			new_buffer[i] = dev->buffer[(dev->buffer_tail + i) % old_size];
+		}
+
+		old_buffer = dev->buffer;
+		dev->buffer = new_buffer;
+		dev->buffer_size = new_size;
+		dev->buffer_head = count < new_size ? count : 0;
+		dev->buffer_tail = 0;
+		restore_flags(flags);
+		up(&dev->sem);
 
-		if (buffer_count[minor] < new_size)
-			wake_up(&write_queue[minor]);
+		kfree(old_buffer);
+		if (count < new_size)
+			wake_up(&dev->write_queue);
 
 		break;
 
 	case MORSE_IOC_GET_BUFFER_SIZE:
-		put_user(buffer_size[minor], (int *)arg);
+		put_user(dev->buffer_size, (int *)arg);
 		break;
 
+	case MORSE_IOC_DRAIN:
+		return morse_drain(dev, file);
+
+	case MORSE_IOC_GET_STATUS:
+		get_status(dev, &status);
+		memcpy_tofs((void *)arg, &status, sizeof(struct morse_status));
+		break;
+
+	case MORSE_IOC_SET_BEACON:
+		if ((err = verify_area(VERIFY_READ, (void *)arg, sizeof(struct morse_beacon))) < 0)
+			return err;
+		memcpy_fromfs(&beacon_config, (void *)arg, sizeof(struct morse_beacon));
+		return set_beacon(dev, &beacon_config);
+
+#ifdef MORSE_RING_FEED
+	case MORSE_IOC_ATTACH_RING:
+		return attach_ring(dev, (int)arg);
+#endif
+
 	default:
 		return -EINVAL;
 	}
@@ -450,33 +1687,510 @@ int morse_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsign
 }
 
 struct file_operations morse_ops = {
+	read : morse_read,
 	write : morse_write,
+	select : morse_select,
 	ioctl : morse_ioctl,
 	open : morse_open,
-	release : morse_release
+	release : morse_release,
+	fsync : morse_fsync
 };
 
-int morse_init(void)
+// Decoder
+//
+// Each decoder turns (state, duration) samples into text. The dot length
+// is estimated online from the marks and the short gaps, so the samples
+// may use any time unit and the sender may drift in speed. A mark is a
+// dash when it is longer than two dots; a gap ends a letter when longer
+// than two dots and a word when longer than five. Letters are looked up
+// by walking a binary trie of the code table: a dot goes to the left
+// child (2n), a dash to the right one (2n + 1).
+//
+// A lone first mark could be either a dot or a dash, so the first samples
+// are held back until the marks show enough contrast to tell, and are
+// then replayed with the estimate that gives.
+static char decode_trie[DECODE_TRIE_SIZE];
+
+// Everything about one decoder, only ever touched from process context
+// with sem held, apart from the counts the wait loops look at. decoded
+// is a circular buffer of text not read yet.
+struct morse_decoder
+{
+	int dot_estimate; // 0 = not known yet, samples are held back
+	int node;	  // in decode_trie, 0 = not a valid code
+	int space;	  // a word space was already sent
+
+	struct morse_sample history[DECODE_HISTORY];
+	int history_len;
+
+	char decoded[DECODER_BUFFER_SIZE];
+	int decoded_head;
+	int decoded_tail;
+	int decoded_count;
+
+	int in_use;
+	struct semaphore sem;
+	struct wait_queue *read_queue;
+	struct wait_queue *write_queue;
+};
+
+static struct morse_decoder morse_decoders[DECODERS_COUNT];
+
+int get_decoder(struct inode *inode)
+{
+	int decoder = MINOR(inode->i_rdev) - DECODER_MINOR;
+	if (decoder < 0 || decoder >= DECODERS_COUNT)
+	{
+		return -ENODEV;
+	}
+	return decoder;
+}
+
+// Letters decode to upper case, and prosigns without punctuation of
+// their own to their control bytes: the table is walked from the space
+// onwards and the first byte found for a code is kept.
+static void build_decode_trie(void)
+{
+	int i, ch, node;
+	unsigned short code;
+
+	for (i = 0; i < 256; i++)
+	{
+		ch = (i + ' ') & 0xff;
+		code = morse_table[ch];
+		if (code <= CODE_SPACE)
+			continue;
+		for (node = 1; code != 1; code >>= 1)
+			node = 2 * node + (code & DAH);
+		if (decode_trie[node] == 0)
+			decode_trie[node] = ch;
+	}
+}
+
+static void decoder_emit(struct morse_decoder *dec, char ch)
+{
+	if (dec->decoded_count == DECODER_BUFFER_SIZE)
+		return;
+
+	dec->decoded[dec->decoded_head] = ch;
+	dec->decoded_head = (dec->decoded_head + 1) % DECODER_BUFFER_SIZE;
+	dec->decoded_count++;
+}
+
+static void decoder_end_letter(struct morse_decoder *dec)
+{
+	int node = dec->node;
+
+	// Unknown codes are dropped, like unsupported characters are
+	if (node > 1 && decode_trie[node] != 0)
+	{
+		decoder_emit(dec, decode_trie[node]);
+		dec->space = 0;
+	}
+	dec->node = 1;
+}
+
+static void decode_element(struct morse_decoder *dec, struct morse_sample *sample)
+{
+	int duration = sample->duration;
+	int dot = dec->dot_estimate;
+
+	if (sample->state)
+	{
+		// Much shorter than a dot: the sender sped up a lot
+		if (duration < dot / 2)
+			dot = duration;
+
+		if (duration < 2 * dot)
+		{
+			dec->node = 2 * dec->node;
+			dot = (3 * dot + duration) / 4;
+		}
+		else
+		{
+			dec->node = 2 * dec->node + 1;
+			dot = (3 * dot + duration / 3) / 4;
+		}
+		if (dec->node >= DECODE_TRIE_SIZE)
+			dec->node = 0;
+
+		dec->dot_estimate = dot > 0 ? dot : 1;
+		return;
+	}
+
+	if (duration < 2 * dot)
+	{
+		dec->dot_estimate = (3 * dot + duration) / 4;
+	}
+	else if (dec->node != 1)
+	{
+		decoder_end_letter(dec);
+	}
+
+	if (duration >= 5 * dot && !dec->space)
+	{
+		decoder_emit(dec, ' ');
+		dec->space = 1;
+	}
+}
+
+// Guesses the dot length from the held back samples. Returns 0 when they
+// cannot tell yet, unless force is set.
+static int decoder_lock(struct morse_decoder *dec, int force)
+{
+	struct morse_sample *sample;
+	int i, shortest_mark = 0, longest_mark = 0, shortest_gap = 0;
+
+	for (i = 0; i < dec->history_len; i++)
+	{
+		sample = &dec->history[i];
+		if (sample->state)
+		{
+			if (shortest_mark == 0 || sample->duration < shortest_mark)
+				shortest_mark = sample->duration;
+			if (sample->duration > longest_mark)
+				longest_mark = sample->duration;
+		}
+		else if (shortest_gap == 0 || sample->duration < shortest_gap)
+		{
+			shortest_gap = sample->duration;
+		}
+	}
+
+	// Dots and dashes side by side
+	if (longest_mark >= 2 * shortest_mark)
+		return shortest_mark;
+
+	// Only dashes so far, with a gap between two of them
+	if (shortest_gap != 0 && 2 * shortest_gap <= shortest_mark)
+		return shortest_gap;
+
+	return force ? shortest_mark : 0;
+}
+
+static void decoder_replay(struct morse_decoder *dec, int force)
+{
+	int i, dot = decoder_lock(dec, force);
+
+	if (dot == 0)
+		return;
+
+	dec->dot_estimate = dot;
+	for (i = 0; i < dec->history_len; i++)
+		decode_element(dec, &dec->history[i]);
+	dec->history_len = 0;
+}
+
+// Called with sem held and room for DECODE_ROOM more characters
+static void decode_sample(struct morse_decoder *dec, struct morse_sample *sample)
+{
+	if (sample->duration <= 0)
+		return;
+
+	if (dec->dot_estimate != 0)
+	{
+		decode_element(dec, sample);
+		return;
+	}
+
+	// Silence before the first mark means nothing
+	if (!sample->state && dec->history_len == 0)
+		return;
+
+	dec->history[dec->history_len++] = *sample;
+	decoder_replay(dec, dec->history_len == DECODE_HISTORY);
+}
+
+int decoder_open(struct inode *inode, struct file *file)
+{
+	int decoder = get_decoder(inode);
+	struct morse_decoder *dec;
+
+	if (decoder < 0)
+	{
+		return decoder;
+	}
+	dec = &morse_decoders[decoder];
+
+	down(&dec->sem);
+	MOD_INC_USE_COUNT;
+	dec->in_use++;
+	if (dec->in_use == 1)
+	{
+		dec->dot_estimate = 0;
+		dec->history_len = 0;
+		dec->node = 1;
+		dec->space = 1;
+		dec->decoded_head = 0;
+		dec->decoded_tail = 0;
+		dec->decoded_count = 0;
+	}
+	up(&dec->sem);
+
+	return 0;
+}
+
+void decoder_release(struct inode *inode, struct file *file)
 {
+	int decoder = get_decoder(inode);
+	struct morse_decoder *dec;
+
+	if (decoder < 0)
+	{
+		return;
+	}
+	dec = &morse_decoders[decoder];
+
+	down(&dec->sem);
+	dec->in_use--;
+	up(&dec->sem);
+
+	// A reader may be waiting for a writer that just went away
+	wake_up(&dec->read_queue);
+	MOD_DEC_USE_COUNT;
+}
+
+int decoder_read(struct inode *inode, struct file *file, char *buf, int count)
+{
+	int decoder = get_decoder(inode);
+	struct morse_decoder *dec;
+	int i;
+	char ch;
+
+	if (decoder < 0)
+	{
+		return decoder;
+	}
+	dec = &morse_decoders[decoder];
+
+	for (i = 0; i < count; i++)
+	{
+		while (dec->decoded_count == 0)
+		{
+			// Return what we have rather than wait for more
+			if (i > 0 || dec->in_use == 1)
+				return i;
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+
+			interruptible_sleep_on(&dec->read_queue);
+
+			if (current->signal & ~current->blocked)
+			{
+				return -ERESTARTSYS;
+			}
+		}
+
+		down(&dec->sem);
+		ch = dec->decoded[dec->decoded_tail];
+		dec->decoded_tail = (dec->decoded_tail + 1) % DECODER_BUFFER_SIZE;
+		dec->decoded_count--;
+		up(&dec->sem);
+
+		wake_up(&dec->write_queue);
+		put_user(ch, buf + i);
+	}
+	return count;
+}
+
+int decoder_write(struct inode *inode, struct file *file, const char *buf, int count)
+{
+	int decoder = get_decoder(inode);
+	struct morse_decoder *dec;
+	struct morse_sample sample;
+	int i, err;
+
+	if (decoder < 0)
+	{
+		return decoder;
+	}
+	dec = &morse_decoders[decoder];
+
+	if (count % sizeof(struct morse_sample) != 0)
+		return -EINVAL;
+	if ((err = verify_area(VERIFY_READ, buf, count)) < 0)
+		return err;
+
+	for (i = 0; i < count; i += sizeof(struct morse_sample))
+	{
+		while (dec->decoded_count > DECODER_BUFFER_SIZE - DECODE_ROOM)
+		{
+			if (i > 0)
+				return i;
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+
+			interruptible_sleep_on(&dec->write_queue);
+
+			if (current->signal & ~current->blocked)
+			{
+				return -ERESTARTSYS;
+			}
+		}
+
+		memcpy_fromfs(&sample, buf + i, sizeof(struct morse_sample));
+		down(&dec->sem);
+		decode_sample(dec, &sample);
+		up(&dec->sem);
+
+		wake_up(&dec->read_queue);
+	}
+	return count;
+}
+
+int decoder_select(struct inode *inode, struct file *file, int sel_type, select_table *wait)
+{
+	int decoder = get_decoder(inode);
+	struct morse_decoder *dec;
+
+	if (decoder < 0)
+	{
+		return 0;
+	}
+	dec = &morse_decoders[decoder];
+
+	switch (sel_type)
+	{
+	case SEL_IN:
+		if (dec->decoded_count > 0)
+			return 1;
+		select_wait(&dec->read_queue, wait);
+		return 0;
+
+	case SEL_OUT:
+		if (dec->decoded_count <= DECODER_BUFFER_SIZE - DECODE_ROOM)
+			return 1;
+		select_wait(&dec->write_queue, wait);
+		return 0;
+	}
+	return 0;
+}
+
+// End of stream: the last letter has no gap after it to complete it
+int decoder_fsync(struct inode *inode, struct file *file)
+{
+	int decoder = get_decoder(inode);
+	struct morse_decoder *dec;
+
+	if (decoder < 0)
+	{
+		return decoder;
+	}
+	dec = &morse_decoders[decoder];
+
+	down(&dec->sem);
+	if (dec->dot_estimate == 0)
+		decoder_replay(dec, 1);
+	decoder_end_letter(dec);
+	up(&dec->sem);
+
+	wake_up(&dec->read_queue);
+	return 0;
+}
+
+struct file_operations decoder_ops = {
+	read : decoder_read,
+	write : decoder_write,
+	select : decoder_select,
+	open : decoder_open,
+	release : decoder_release,
+	fsync : decoder_fsync
+};
+
+static void free_devices(int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (morse_devs[i]->buffer != NULL)
+			kfree(morse_devs[i]->buffer);
+		kfree(morse_devs[i]);
+	}
+	kfree(morse_devs);
+	morse_devs = NULL;
+}
+
+// Each device is allocated on its own, so that the timers of different
+// devices never share cache lines
+static int alloc_devices(void)
+{
+	struct morse_dev *dev;
 	int i;
-	for (i = 0; i < DEVICES_COUNT; i++)
+
+	morse_devs = kmalloc(devices * sizeof(struct morse_dev *), GFP_KERNEL);
+	if (morse_devs == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < devices; i++)
+	{
+		dev = kmalloc(sizeof(struct morse_dev), GFP_KERNEL);
+		if (dev == NULL)
+		{
+			free_devices(i);
+			return -ENOMEM;
+		}
+		memset(dev, 0, sizeof(struct morse_dev));
+		morse_devs[i] = dev;
+
+		init_waitqueue(&dev->write_queue);
+		init_waitqueue(&dev->drain_queue);
+		init_waitqueue(&dev->read_queue);
+		dev->buffer_size = DEFAULT_BUFFER_SIZE;
+		dev->sem = MUTEX;
+		dev->ring_minor = -1;
+
+		dev->dot_duration = msecs_to_ticks(DOT_DURATION);
+		dev->dash_duration = msecs_to_ticks(DASH_DURATION);
+		dev->symbol_pause = msecs_to_ticks(SYMBOL_PAUSE);
+		dev->letter_pause = msecs_to_ticks(LETTER_PAUSE);
+		dev->word_pause = msecs_to_ticks(WORD_PAUSE);
+
+		// Matches the original layout: one cell every two columns,
+		// carried over to the following rows for extra devices
+		dev->output_type = MORSE_OUTPUT_SCREEN;
+		dev->screen_config.console = -1;
+		dev->screen_config.row = 2 * i / video_num_columns;
+		dev->screen_config.column = 2 * i % video_num_columns;
+		dev->screen_config.colour = 0x44;
+
+		init_timer(&dev->timer);
+		dev->timer.function = morse_timer_function;
+		dev->timer.data = (unsigned long)dev;
+	}
+
+	return 0;
+}
+
+int morse_init(void)
+{
+	int i, result;
+
+	if (devices < 1 || devices > MAX_DEVICES)
 	{
-		init_waitqueue(&write_queue[i]);
-		device_in_use[i] = 0;
-		buffer_size[i] = DEFAULT_BUFFER_SIZE;
-		sem[i] = MUTEX;
+		printk("morse: devices must be between 1 and %d\n", MAX_DEVICES);
+		return -EINVAL;
+	}
+	if ((result = alloc_devices()) < 0)
+		return result;
 
-		dot_duration[i] = DOT_DURATION;
-		dash_duration[i] = DASH_DURATION;
-		symbol_pause[i] = SYMBOL_PAUSE;
-		letter_pause[i] = LETTER_PAUSE;
-		word_pause[i] = WORD_PAUSE;
+	for (i = 0; i < DECODERS_COUNT; i++)
+	{
+		init_waitqueue(&morse_decoders[i].read_queue);
+		init_waitqueue(&morse_decoders[i].write_queue);
+		morse_decoders[i].in_use = 0;
+		morse_decoders[i].sem = MUTEX;
+	}
+	build_decode_trie();
 
-		init_timer(&morse_timer[i]);
-		morse_timer[i].function = morse_timer_function;
-		morse_timer[i].data = i;
+	result = register_chrdev(MORSE_MAJOR, "morse", &morse_ops);
+	if (result < 0)
+	{
+		free_devices(devices);
+		return result;
 	}
-	return register_chrdev(MORSE_MAJOR, "morse", &morse_ops);
+	proc_register_dynamic(&proc_root, &proc_morse);
+	return 0;
 }
 
 int init_module()
@@ -492,5 +2206,15 @@ int init_module()
 
 void cleanup_module()
 {
+#ifdef MORSE_RING_FEED
+	int i;
+
+	for (i = 0; i < devices; i++)
+		if (morse_devs[i]->ring_minor >= 0)
+			ring_detach(morse_devs[i]->ring_minor);
+#endif
+
+	proc_unregister(&proc_root, proc_morse.low_ino);
 	unregister_chrdev(MORSE_MAJOR, "morse");
+	free_devices(devices);
 }
\ No newline at end of file
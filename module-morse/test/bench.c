@@ -0,0 +1,130 @@
+/*
+ * bench.c
+ *
+ * Measures morse.c in userspace: the cost of queueing text with write(),
+ * of each timer callback while transmitting, and of decoding samples.
+ * Simulated time runs on the virtual clock, so hours of transmission
+ * take a fraction of a second.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "morse.c"
+
+#define ROUNDS 2000
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_encoder(void)
+{
+	struct inode inode;
+	struct file file;
+	struct morse_speed speed = {MAX_WPM, 0};
+	char text[MAX_BUFFER_SIZE];
+	unsigned long start_jiffies, runs, chars = 0;
+	double start, write_time = 0, timer_time;
+	int i;
+
+	for (i = 0; i < sizeof(text); i++)
+		text[i] = "PARIS 0123456789 THE QUICK BROWN FOX"[i % 36];
+
+	sim_file_init(&inode, &file, MORSE_MAJOR, 0, 0);
+	sim_open(&inode, &file);
+	sim_ioctl(&inode, &file, MORSE_IOC_SET_BUFFER_SIZE, MAX_BUFFER_SIZE);
+	sim_ioctl(&inode, &file, MORSE_IOC_SET_SPEED, (unsigned long)&speed);
+
+	start_jiffies = jiffies;
+	runs = sim_timer_runs;
+	timer_time = 0;
+	for (i = 0; i < ROUNDS; i++)
+	{
+		start = now();
+		chars += sim_write(&inode, &file, text, sizeof(text));
+		write_time += now() - start;
+
+		start = now();
+		sim_run_until_idle(~0UL >> 1);
+		timer_time += now() - start;
+	}
+	runs = sim_timer_runs - runs;
+
+	printf("write:  %lu bytes, %.1f ns/byte\n", chars, write_time * 1e9 / chars);
+	printf("timer:  %lu callbacks, %.1f ns/callback\n", runs, timer_time * 1e9 / runs);
+	printf("        %.1f hours of %d wpm sent in %.3f s\n",
+	       (double)(jiffies - start_jiffies) / HZ / 3600, MAX_WPM, timer_time);
+
+	sim_release(&inode, &file);
+}
+
+static void bench_decoder(void)
+{
+	struct inode inode;
+	struct file file;
+	struct morse_sample samples[512];
+	unsigned long count = 0;
+	char text[DECODER_BUFFER_SIZE];
+	double start, elapsed = 0;
+	int i, j = 0, length = 0;
+
+	// "PARIS " over and over, in dot units
+	static const char *paris = ".--. .- .-. .. ...";
+	for (i = 0; i < 512; i += 2)
+	{
+		samples[i].state = 1;
+		samples[i].duration = paris[j++] == '-' ? 3 : 1;
+		samples[i + 1].state = 0;
+		if (paris[j] == '\0')
+		{
+			samples[i + 1].duration = 7;
+			j = 0;
+		}
+		else if (paris[j] == ' ')
+		{
+			samples[i + 1].duration = 3;
+			j++;
+		}
+		else
+		{
+			samples[i + 1].duration = 1;
+		}
+	}
+
+	sim_file_init(&inode, &file, MORSE_MAJOR, DECODER_MINOR, O_NONBLOCK);
+	sim_open(&inode, &file);
+	for (i = 0; i < ROUNDS * 10; i++)
+	{
+		start = now();
+		count += sim_write(&inode, &file, (char *)samples, sizeof(samples)) /
+			 sizeof(struct morse_sample);
+		elapsed += now() - start;
+		length += sim_read(&inode, &file, text, sizeof(text));
+	}
+	printf("decode: %lu samples, %.1f ns/sample, %d characters\n",
+	       count, elapsed * 1e9 / count, length);
+	sim_release(&inode, &file);
+}
+
+int main()
+{
+	sim_init();
+	sim_tracing = 0;
+	if (init_module() != 0)
+	{
+		printf("init_module failed\n");
+		return 1;
+	}
+
+	bench_encoder();
+	bench_decoder();
+
+	cleanup_module();
+	return 0;
+}
@@ -0,0 +1,13 @@
+#!/bin/bash
+
+# Builds morse.c as a userspace program against the kernel shim in shim/.
+# The test also links in ring.c, so that it can cover MORSE_RING_FEED;
+# the names both modules define are renamed on the ring side.
+
+cd "$(dirname "$0")"
+
+RING_NAMES="-Dinit_module=ring_init_module -Dcleanup_module=ring_cleanup_module -Dget_minor=ring_get_minor"
+
+gcc -O2 -I shim $RING_NAMES -c -o ring.o ../../module-ring/ring.c &&
+	gcc -O2 -I shim -I .. -DMORSE_RING_FEED -o test test.c sim.c ring.o -lpthread &&
+	gcc -O2 -I shim -I .. -o bench bench.c sim.c -lpthread
@@ -0,0 +1,2 @@
+#include <asm/errno.h>
+#include "../sim.h"
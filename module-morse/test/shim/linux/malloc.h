@@ -0,0 +1 @@
+#include "../sim.h"
@@ -0,0 +1,3 @@
+/* Opens a struct symbol_table initializer, as in the kernel */
+#define X(sym) { (void *)&sym, #sym }
+	0, 0, 0, {
@@ -0,0 +1,3 @@
+/* Closes a struct symbol_table initializer */
+	{ (void *)0, (char *)0 } }
+#undef X
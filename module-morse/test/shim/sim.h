@@ -0,0 +1,260 @@
+/*
+ * sim.h
+ *
+ * Minimal stand-ins for the Linux 2.0 kernel interfaces used by morse.c,
+ * so the driver can be built and run as an ordinary userspace program.
+ *
+ * Time is virtual: jiffies only advance through sim_advance(), which runs
+ * expired timers exactly like the kernel timer bottom half would.  All
+ * "kernel" code runs under one big lock, which models a uniprocessor
+ * kernel: cli()/sti() are no-ops and sleeping drops the lock.
+ */
+
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define __KERNEL__
+#define MODULE
+
+#define HZ 100
+#define ERESTARTSYS 512
+
+#define MINORBITS 8
+#define MINORMASK ((1 << MINORBITS) - 1)
+#define MAJOR(dev) ((dev) >> MINORBITS)
+#define MINOR(dev) ((dev) & MINORMASK)
+#define MKDEV(ma, mi) ((ma) << MINORBITS | (mi))
+
+typedef unsigned short kdev_t;
+
+extern volatile unsigned long jiffies;
+
+/* ioctl numbers, as in asm/ioctl.h */
+#define _IOC_NRBITS 8
+#define _IOC_TYPEBITS 8
+#define _IOC_SIZEBITS 14
+#define _IOC_DIRBITS 2
+#define _IOC_NRSHIFT 0
+#define _IOC_TYPESHIFT (_IOC_NRSHIFT + _IOC_NRBITS)
+#define _IOC_SIZESHIFT (_IOC_TYPESHIFT + _IOC_TYPEBITS)
+#define _IOC_DIRSHIFT (_IOC_SIZESHIFT + _IOC_SIZEBITS)
+#define _IOC_NONE 0U
+#define _IOC_WRITE 1U
+#define _IOC_READ 2U
+#define _IOC(dir, type, nr, size) \
+	(((dir) << _IOC_DIRSHIFT) | ((type) << _IOC_TYPESHIFT) | \
+	 ((nr) << _IOC_NRSHIFT) | ((size) << _IOC_SIZESHIFT))
+#define _IO(type, nr) _IOC(_IOC_NONE, (type), (nr), 0)
+#define _IOR(type, nr, size) _IOC(_IOC_READ, (type), (nr), sizeof(size))
+#define _IOW(type, nr, size) _IOC(_IOC_WRITE, (type), (nr), sizeof(size))
+#define _IOWR(type, nr, size) _IOC(_IOC_READ | _IOC_WRITE, (type), (nr), sizeof(size))
+#define _IOC_DIR(nr) (((nr) >> _IOC_DIRSHIFT) & ((1 << _IOC_DIRBITS) - 1))
+#define _IOC_SIZE(nr) (((nr) >> _IOC_SIZESHIFT) & ((1 << _IOC_SIZEBITS) - 1))
+
+/* Processes */
+struct task_struct
+{
+	unsigned long signal;
+	unsigned long blocked;
+};
+extern __thread struct task_struct *sim_current;
+#define current sim_current
+
+/* Interrupt flags: everything already runs under the big lock */
+#define save_flags(flags) ((flags) = 0)
+#define restore_flags(flags) ((void)(flags))
+#define cli() do { } while (0)
+#define sti() do { } while (0)
+#define barrier() __asm__ __volatile__("" : : : "memory")
+
+/* Wait queues and semaphores */
+struct wait_queue;
+extern void init_waitqueue(struct wait_queue **q);
+extern void sleep_on(struct wait_queue **q);
+extern void interruptible_sleep_on(struct wait_queue **q);
+extern void wake_up(struct wait_queue **q);
+extern void wake_up_interruptible(struct wait_queue **q);
+
+struct semaphore
+{
+	int count;
+	int waking;
+	int lock;
+	struct wait_queue *wait;
+};
+#define MUTEX ((struct semaphore){1, 0, 0, NULL})
+extern void down(struct semaphore *sem);
+extern void up(struct semaphore *sem);
+
+/* Timers */
+struct timer_list
+{
+	struct timer_list *next;
+	struct timer_list *prev;
+	unsigned long expires;
+	unsigned long data;
+	void (*function)(unsigned long);
+};
+extern void init_timer(struct timer_list *timer);
+extern void add_timer(struct timer_list *timer);
+extern int del_timer(struct timer_list *timer);
+
+/* Memory */
+#define GFP_BUFFER 0x00
+#define GFP_ATOMIC 0x01
+#define GFP_KERNEL 0x03
+extern void *kmalloc(size_t size, int priority);
+extern void kfree(void *obj);
+#define kfree_s(obj, size) kfree(obj)
+
+/* User space access: the "user" shares our address space */
+#define VERIFY_READ 0
+#define VERIFY_WRITE 1
+#define verify_area(type, addr, size) ((void)(type), (void)(addr), (void)(size), 0)
+#define get_user(ptr) (*(ptr))
+#define put_user(x, ptr) ((void)(*(ptr) = (x)))
+#define memcpy_fromfs(to, from, n) memcpy((to), (from), (n))
+#define memcpy_tofs(to, from, n) memcpy((to), (from), (n))
+
+/* Files */
+#define O_NONBLOCK 04000
+
+struct inode
+{
+	kdev_t i_rdev;
+};
+
+struct file_operations;
+
+struct file
+{
+	struct file_operations *f_op;
+	unsigned short f_mode;
+	unsigned short f_flags;
+	loff_t f_pos;
+};
+
+#define SEL_IN 1
+#define SEL_OUT 2
+#define SEL_EX 4
+typedef struct select_table_struct
+{
+	int nr;
+} select_table;
+extern void select_wait(struct wait_queue **q, select_table *p);
+
+struct file_operations
+{
+	int (*lseek)(struct inode *, struct file *, off_t, int);
+	int (*read)(struct inode *, struct file *, char *, int);
+	int (*write)(struct inode *, struct file *, const char *, int);
+	int (*readdir)(struct inode *, struct file *, void *, void *);
+	int (*select)(struct inode *, struct file *, int, select_table *);
+	int (*ioctl)(struct inode *, struct file *, unsigned int, unsigned long);
+	int (*mmap)(struct inode *, struct file *, void *);
+	int (*open)(struct inode *, struct file *);
+	void (*release)(struct inode *, struct file *);
+	int (*fsync)(struct inode *, struct file *);
+	int (*fasync)(struct inode *, struct file *, int);
+	int (*check_media_change)(kdev_t dev);
+	int (*revalidate)(kdev_t dev);
+};
+extern int register_chrdev(unsigned int major, const char *name, struct file_operations *fops);
+extern int unregister_chrdev(unsigned int major, const char *name);
+
+/* Modules */
+extern int sim_mod_use_count;
+#define MOD_INC_USE_COUNT (sim_mod_use_count++)
+#define MOD_DEC_USE_COUNT (sim_mod_use_count--)
+
+/* Exported symbols: nothing resolves them here, they are only kept */
+struct internal_symbol
+{
+	void *addr;
+	const char *name;
+};
+struct symbol_table
+{
+	int size;
+	int n_symbols;
+	int n_refs;
+	struct internal_symbol symbol[];
+};
+#define register_symtab(symtab) ((void)(symtab))
+
+extern int printk(const char *fmt, ...);
+
+/* Console */
+#define MAX_NR_CONSOLES 63
+extern int fg_console;
+extern unsigned long video_num_columns;
+extern unsigned long video_num_lines;
+extern void kd_mksound(unsigned int hz, unsigned int ticks);
+
+/* /proc: entries are only kept so that their get_info can be called */
+#define S_IRUGO (S_IRUSR | S_IRGRP | S_IROTH)
+
+struct proc_dir_entry
+{
+	unsigned short low_ino;
+	unsigned short namelen;
+	const char *name;
+	mode_t mode;
+	nlink_t nlink;
+	uid_t uid;
+	gid_t gid;
+	unsigned long size;
+	void *ops;
+	int (*get_info)(char *, char **, off_t, int, int);
+	struct proc_dir_entry *next;
+};
+extern struct proc_dir_entry proc_root;
+extern int proc_register_dynamic(struct proc_dir_entry *dir, struct proc_dir_entry *entry);
+extern int proc_unregister(struct proc_dir_entry *dir, int ino);
+
+/* Simulation control, for tests and benchmarks only */
+#define SIM_SCREEN_CELLS (80 * 25)
+extern unsigned short sim_screen[SIM_SCREEN_CELLS];
+
+struct sim_event
+{
+	unsigned long time;
+	int cell;
+	unsigned short value;
+};
+extern struct sim_event *sim_trace;
+extern int sim_trace_len;
+
+extern unsigned long sim_timer_runs;	/* timer callbacks run so far */
+extern int sim_tracing;			/* record screen changes into sim_trace */
+extern unsigned long sim_timer_kfrees;	/* kfree() calls made by timers */
+
+extern void sim_init(void);
+extern void sim_lock(void);
+extern void sim_unlock(void);
+extern void sim_advance(unsigned long ticks);
+extern int sim_run_until_idle(unsigned long limit);
+extern void sim_wait_sleepers(int count);
+extern void sim_trace_clear(void);
+
+extern void sim_file_init(struct inode *inode, struct file *file,
+			  unsigned int major, int minor, int flags);
+extern int sim_open(struct inode *inode, struct file *file);
+extern void sim_release(struct inode *inode, struct file *file);
+extern int sim_read(struct inode *inode, struct file *file, char *buf, int count);
+extern int sim_write(struct inode *inode, struct file *file, const char *buf, int count);
+extern int sim_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg);
+extern int sim_select(struct inode *inode, struct file *file, int sel_type);
+extern int sim_fsync(struct inode *inode, struct file *file);
+
+/* Reads a whole /proc entry into buf, NUL terminated; -ENOENT if missing */
+extern int sim_proc_read(const char *name, char *buf, int count);
+
+#endif /* _SIM_H */
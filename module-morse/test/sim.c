@@ -0,0 +1,465 @@
+/*
+ * sim.c
+ *
+ * Userspace implementation of the kernel interfaces declared in sim.h.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+
+volatile unsigned long jiffies;
+int sim_mod_use_count;
+int fg_console;
+unsigned long video_num_columns = 80;
+unsigned long video_num_lines = 25;
+
+static struct task_struct main_task;
+__thread struct task_struct *sim_current = &main_task;
+
+/*
+ * console_struct.h only needs struct vc_data; its accessor macros are
+ * harmless here as long as we avoid the names they take over.
+ */
+#include "console_struct.h"
+
+static struct vc_data sim_vc_data;
+struct vc vc_cons[MAX_NR_CONSOLES];
+unsigned short sim_screen[SIM_SCREEN_CELLS];
+static unsigned short sim_snapshot[SIM_SCREEN_CELLS];
+
+struct sim_event *sim_trace;
+int sim_trace_len;
+static int sim_trace_cap;
+
+static pthread_mutex_t big_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sleepers_changed = PTHREAD_COND_INITIALIZER;
+static int sleepers;
+static unsigned long wake_generation;
+
+static struct timer_list timer_head = {&timer_head, &timer_head, 0, 0, NULL};
+static struct file_operations *chrdevs[256];
+
+void sim_lock(void)
+{
+	pthread_mutex_lock(&big_lock);
+}
+
+void sim_unlock(void)
+{
+	pthread_mutex_unlock(&big_lock);
+}
+
+int printk(const char *fmt, ...)
+{
+	(void)fmt;
+	return 0;
+}
+
+void *kmalloc(size_t size, int priority)
+{
+	(void)priority;
+	return malloc(size ? size : 1);
+}
+
+unsigned long sim_timer_kfrees;
+static int in_timer;
+
+void kfree(void *obj)
+{
+	if (in_timer)
+		sim_timer_kfrees++;
+	free(obj);
+}
+
+void kd_mksound(unsigned int hz, unsigned int ticks)
+{
+	(void)hz;
+	(void)ticks;
+}
+
+/*
+ * Wait queues: every queue shares one condition variable.  Kernel code
+ * always rechecks its condition after sleeping, so spurious wakeups are
+ * harmless and keep the shim simple.
+ */
+void init_waitqueue(struct wait_queue **q)
+{
+	*q = NULL;
+}
+
+void interruptible_sleep_on(struct wait_queue **q)
+{
+	unsigned long generation = wake_generation;
+
+	(void)q;
+	sleepers++;
+	pthread_cond_broadcast(&sleepers_changed);
+	while (generation == wake_generation &&
+	       !(current->signal & ~current->blocked))
+		pthread_cond_wait(&wakeup, &big_lock);
+	sleepers--;
+}
+
+void sleep_on(struct wait_queue **q)
+{
+	interruptible_sleep_on(q);
+}
+
+void wake_up(struct wait_queue **q)
+{
+	(void)q;
+	wake_generation++;
+	pthread_cond_broadcast(&wakeup);
+}
+
+void wake_up_interruptible(struct wait_queue **q)
+{
+	wake_up(q);
+}
+
+void select_wait(struct wait_queue **q, select_table *p)
+{
+	(void)q;
+	if (p)
+		p->nr++;
+}
+
+void sim_wait_sleepers(int count)
+{
+	sim_lock();
+	while (sleepers < count)
+		pthread_cond_wait(&sleepers_changed, &big_lock);
+	sim_unlock();
+}
+
+void down(struct semaphore *sem)
+{
+	while (sem->count <= 0)
+		sleep_on(&sem->wait);
+	sem->count--;
+}
+
+void up(struct semaphore *sem)
+{
+	sem->count++;
+	wake_up(&sem->wait);
+}
+
+/* Timers are kept sorted by expiry, as in kernel/sched.c */
+void init_timer(struct timer_list *timer)
+{
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+void add_timer(struct timer_list *timer)
+{
+	struct timer_list *p = timer_head.next;
+
+	if (timer->next)
+	{
+		fprintf(stderr, "sim: add_timer() on a pending timer\n");
+		abort();
+	}
+	while (p != &timer_head && p->expires <= timer->expires)
+		p = p->next;
+	timer->next = p;
+	timer->prev = p->prev;
+	p->prev->next = timer;
+	p->prev = timer;
+}
+
+int del_timer(struct timer_list *timer)
+{
+	if (!timer->next)
+		return 0;
+	timer->next->prev = timer->prev;
+	timer->prev->next = timer->next;
+	timer->next = NULL;
+	timer->prev = NULL;
+	return 1;
+}
+
+static void record_screen(void)
+{
+	int i;
+
+	for (i = 0; i < SIM_SCREEN_CELLS; i++)
+	{
+		if (sim_screen[i] == sim_snapshot[i])
+			continue;
+		if (sim_trace_len == sim_trace_cap)
+		{
+			sim_trace_cap = sim_trace_cap ? 2 * sim_trace_cap : 1024;
+			sim_trace = realloc(sim_trace, sim_trace_cap * sizeof(*sim_trace));
+		}
+		sim_trace[sim_trace_len].time = jiffies;
+		sim_trace[sim_trace_len].cell = i;
+		sim_trace[sim_trace_len].value = sim_screen[i];
+		sim_trace_len++;
+		sim_snapshot[i] = sim_screen[i];
+	}
+}
+
+void sim_trace_clear(void)
+{
+	sim_trace_len = 0;
+}
+
+unsigned long sim_timer_runs;
+int sim_tracing = 1;
+
+static void run_timers(void)
+{
+	struct timer_list *timer;
+
+	while ((timer = timer_head.next) != &timer_head && timer->expires <= jiffies)
+	{
+		del_timer(timer);
+		in_timer = 1;
+		timer->function(timer->data);
+		in_timer = 0;
+		sim_timer_runs++;
+	}
+	if (sim_tracing)
+		record_screen();
+}
+
+/*
+ * Nothing can happen between two timer expiries, so the clock jumps
+ * straight to the next one: simulated time costs nothing while idle.
+ */
+static void advance_to(unsigned long target)
+{
+	unsigned long next;
+
+	while ((long)(target - jiffies) > 0)
+	{
+		next = target;
+		if (timer_head.next != &timer_head &&
+		    (long)(timer_head.next->expires - next) < 0)
+			next = timer_head.next->expires;
+		if ((long)(next - jiffies) <= 0)
+			next = jiffies + 1;
+		jiffies = next;
+		run_timers();
+	}
+}
+
+void sim_advance(unsigned long ticks)
+{
+	sim_lock();
+	advance_to(jiffies + ticks);
+	sim_unlock();
+}
+
+int sim_run_until_idle(unsigned long limit)
+{
+	unsigned long end = jiffies + limit;
+	unsigned long next;
+
+	sim_lock();
+	while (timer_head.next != &timer_head && (long)(end - jiffies) > 0)
+	{
+		next = timer_head.next->expires;
+		if ((long)(next - jiffies) <= 0)
+			next = jiffies + 1;
+		if ((long)(next - end) > 0)
+			next = end;
+		advance_to(next);
+	}
+	sim_unlock();
+	return timer_head.next == &timer_head;
+}
+
+void sim_init(void)
+{
+	int i;
+
+	memset(sim_screen, 0, sizeof(sim_screen));
+	memset(sim_snapshot, 0, sizeof(sim_snapshot));
+	sim_trace_clear();
+	for (i = 0; i < MAX_NR_CONSOLES; i++)
+		vc_cons[i].d = NULL;
+	sim_vc_data.vc_origin = (unsigned long)sim_screen;
+	sim_vc_data.vc_bell_pitch = 750;
+	sim_vc_data.vc_bell_duration = HZ / 8;
+	vc_cons[0].d = &sim_vc_data;
+	fg_console = 0;
+}
+
+int register_chrdev(unsigned int major, const char *name, struct file_operations *fops)
+{
+	(void)name;
+	if (chrdevs[major])
+		return -EBUSY;
+	chrdevs[major] = fops;
+	return 0;
+}
+
+int unregister_chrdev(unsigned int major, const char *name)
+{
+	(void)name;
+	chrdevs[major] = NULL;
+	return 0;
+}
+
+/* File operation wrappers: enter the "kernel" and dispatch by major */
+void sim_file_init(struct inode *inode, struct file *file,
+		   unsigned int major, int minor, int flags)
+{
+	memset(inode, 0, sizeof(*inode));
+	memset(file, 0, sizeof(*file));
+	inode->i_rdev = MKDEV(major, minor);
+	file->f_flags = flags;
+}
+
+#define FOPS(inode) (file->f_op)
+
+int sim_open(struct inode *inode, struct file *file)
+{
+	int result = -ENODEV;
+
+	sim_lock();
+	file->f_op = chrdevs[MAJOR(inode->i_rdev)];
+	if (FOPS(inode) && FOPS(inode)->open)
+		result = FOPS(inode)->open(inode, file);
+	sim_unlock();
+	return result;
+}
+
+void sim_release(struct inode *inode, struct file *file)
+{
+	sim_lock();
+	if (FOPS(inode) && FOPS(inode)->release)
+		FOPS(inode)->release(inode, file);
+	sim_unlock();
+}
+
+int sim_read(struct inode *inode, struct file *file, char *buf, int count)
+{
+	int result = -EINVAL;
+
+	sim_lock();
+	if (FOPS(inode) && FOPS(inode)->read)
+		result = FOPS(inode)->read(inode, file, buf, count);
+	sim_unlock();
+	return result;
+}
+
+int sim_write(struct inode *inode, struct file *file, const char *buf, int count)
+{
+	int result = -EINVAL;
+
+	sim_lock();
+	if (FOPS(inode) && FOPS(inode)->write)
+		result = FOPS(inode)->write(inode, file, buf, count);
+	sim_unlock();
+	return result;
+}
+
+int sim_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg)
+{
+	int result = -EINVAL;
+
+	sim_lock();
+	if (FOPS(inode) && FOPS(inode)->ioctl)
+		result = FOPS(inode)->ioctl(inode, file, cmd, arg);
+	if (sim_tracing)
+		record_screen();
+	sim_unlock();
+	return result;
+}
+
+int sim_select(struct inode *inode, struct file *file, int sel_type)
+{
+	select_table wait = {0};
+	int result = 1;
+
+	sim_lock();
+	if (FOPS(inode) && FOPS(inode)->select)
+		result = FOPS(inode)->select(inode, file, sel_type, &wait);
+	sim_unlock();
+	return result;
+}
+
+struct proc_dir_entry proc_root;
+static unsigned short proc_next_ino = 4096;
+
+int proc_register_dynamic(struct proc_dir_entry *dir, struct proc_dir_entry *entry)
+{
+	(void)dir;
+	entry->low_ino = proc_next_ino++;
+	entry->next = proc_root.next;
+	proc_root.next = entry;
+	return 0;
+}
+
+int proc_unregister(struct proc_dir_entry *dir, int ino)
+{
+	struct proc_dir_entry **p;
+
+	(void)dir;
+	for (p = &proc_root.next; *p; p = &(*p)->next)
+	{
+		if ((*p)->low_ino == ino)
+		{
+			*p = (*p)->next;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+/*
+ * Like fs/proc/generic.c: get_info is handed a page but asked for no more
+ * than PROC_BLOCK_SIZE bytes, so that it may overrun a little.
+ */
+#define PROC_BLOCK_SIZE (3 * 1024)
+
+int sim_proc_read(const char *name, char *buf, int count)
+{
+	struct proc_dir_entry *entry;
+	char page[4096];
+	char *start;
+	int len, total = 0;
+
+	for (entry = proc_root.next; entry; entry = entry->next)
+		if (strcmp(entry->name, name) == 0)
+			break;
+	if (!entry)
+		return -ENOENT;
+
+	sim_lock();
+	while (total < count - 1)
+	{
+		len = count - 1 - total;
+		if (len > PROC_BLOCK_SIZE)
+			len = PROC_BLOCK_SIZE;
+		start = page;
+		len = entry->get_info(page, &start, total, len, 0);
+		if (len <= 0)
+			break;
+		memcpy(buf + total, start, len);
+		total += len;
+	}
+	sim_unlock();
+	buf[total] = '\0';
+	return total;
+}
+
+int sim_fsync(struct inode *inode, struct file *file)
+{
+	int result = -EINVAL;
+
+	sim_lock();
+	if (FOPS(inode) && FOPS(inode)->fsync)
+		result = FOPS(inode)->fsync(inode, file);
+	sim_unlock();
+	return result;
+}
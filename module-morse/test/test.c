@@ -0,0 +1,873 @@
+/*
+ * test.c
+ *
+ * Runs morse.c in userspace against the shim in shim/ and checks the
+ * exact element timelines it produces on a virtual clock.
+ *
+ * console_struct.h, included by morse.c, turns many short names (x, y,
+ * pos, top, attr, ...) into macros: avoid them below.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "morse.c"
+
+#define ON ((0x44 << 8) | ' ')
+
+static int failures;
+
+#define CHECK(cond)                                                         \
+	do                                                                  \
+	{                                                                   \
+		if (!(cond))                                                \
+		{                                                           \
+			printf("  %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++;                                         \
+		}                                                           \
+	} while (0)
+
+struct device
+{
+	struct inode inode;
+	struct file file;
+};
+
+static int device_open(struct device *dev, int minor, int flags)
+{
+	sim_file_init(&dev->inode, &dev->file, MORSE_MAJOR, minor, flags);
+	return sim_open(&dev->inode, &dev->file);
+}
+
+static void device_close(struct device *dev)
+{
+	sim_release(&dev->inode, &dev->file);
+}
+
+static int device_write(struct device *dev, const char *text)
+{
+	return sim_write(&dev->inode, &dev->file, text, strlen(text));
+}
+
+static int device_ioctl(struct device *dev, unsigned int cmd, unsigned long arg)
+{
+	return sim_ioctl(&dev->inode, &dev->file, cmd, arg);
+}
+
+// Collects the on/off transitions of one screen cell, relative to the
+// first one, and compares them with the expected times.
+static int check_timeline(int cell, const unsigned long *expected, int count)
+{
+	unsigned long start = 0;
+	int i, n = 0;
+
+	for (i = 0; i < sim_trace_len; i++)
+	{
+		if (sim_trace[i].cell != cell)
+			continue;
+		if (n == 0)
+			start = sim_trace[i].time;
+		if (n >= count || sim_trace[i].time - start != expected[n] ||
+		    (sim_trace[i].value == ON) != !(n & 1))
+		{
+			printf("  transition %d at %lu (value %04x)\n", n,
+			       sim_trace[i].time - start, sim_trace[i].value);
+			return 0;
+		}
+		n++;
+	}
+	return n == count;
+}
+
+static void test_default_timeline(void)
+{
+	struct device dev;
+	// S O S: dots of 20 jiffies, dashes of 60, gaps of 20 and 60
+	static const unsigned long sos[] = {
+		0, 20, 40, 60, 80, 100,
+		160, 220, 240, 300, 320, 380,
+		440, 460, 480, 500, 520, 540};
+
+	CHECK(device_open(&dev, 0, 0) == 0);
+	CHECK(device_write(&dev, "SOS") == 3);
+	CHECK(sim_run_until_idle(100000));
+	CHECK(check_timeline(0, sos, 18));
+	device_close(&dev);
+}
+
+static void test_word_pause(void)
+{
+	struct device dev;
+	// The word pause replaces the letter pause; # is not supported
+	static const unsigned long text[] = {0, 20, 160, 180, 240, 260};
+	// \r has no code either, and does not keep the \n after it from
+	// replacing the letter pause
+	static const unsigned long crlf[] = {0, 20, 160, 180};
+
+	CHECK(device_open(&dev, 1, 0) == 0);
+	CHECK(device_write(&dev, "E E#E") == 5);
+	CHECK(sim_run_until_idle(100000));
+	CHECK(check_timeline(2, text, 6));
+
+	sim_trace_clear();
+	CHECK(device_write(&dev, "E\r\nE") == 4);
+	CHECK(sim_run_until_idle(100000));
+	CHECK(check_timeline(2, crlf, 4));
+
+	sim_trace_clear();
+	CHECK(device_write(&dev, "E# E") == 4);
+	CHECK(sim_run_until_idle(100000));
+	CHECK(check_timeline(2, crlf, 4));
+	device_close(&dev);
+}
+
+static void test_speed(void)
+{
+	struct device dev;
+	struct morse_speed speed = {100, 0};
+	unsigned long elapsed, expected;
+	char text[601];
+	int i;
+
+	CHECK(device_open(&dev, 2, 0) == 0);
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_BUFFER_SIZE, 1024) == 0);
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_SPEED, (unsigned long)&speed) == 0);
+
+	// 100 x PARIS is 5000 units, less the last word pause; a unit at
+	// 100 wpm is 1.2 jiffies, which only stays on schedule if rounding
+	// errors do not accumulate
+	for (i = 0; i < 100; i++)
+		memcpy(text + 6 * i, "PARIS ", 6);
+	text[600] = '\0';
+	sim_trace_clear();
+	CHECK(device_write(&dev, text) == 600);
+	CHECK(sim_run_until_idle(100000));
+
+	elapsed = sim_trace[sim_trace_len - 1].time - sim_trace[0].time;
+	expected = 4993 * 12 / 10;
+	CHECK(elapsed + expected / 1000 >= expected && elapsed <= expected + expected / 1000);
+	device_close(&dev);
+}
+
+static void test_farnsworth(void)
+{
+	struct device dev;
+	struct morse_speed speed = {20, 5};
+
+	CHECK(device_open(&dev, 3, 0) == 0);
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_SPEED, (unsigned long)&speed) == 0);
+
+	// Characters at 20 wpm: 60 ms units. Gaps for 5 wpm overall:
+	// (60 * 20 - 37.2 * 5) / (19 * 5 * 20) = 0.5337 s per unit
+	CHECK(morse_devs[3]->dot_duration == 6 << JIFFY_SHIFT);
+	CHECK(morse_devs[3]->dash_duration == 18 << JIFFY_SHIFT);
+	CHECK(morse_devs[3]->symbol_pause == 6 << JIFFY_SHIFT);
+	CHECK(morse_devs[3]->letter_pause >> JIFFY_SHIFT == 160);
+	CHECK(morse_devs[3]->word_pause >> JIFFY_SHIFT == 373);
+
+	speed.farnsworth_wpm = 21;
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_SPEED, (unsigned long)&speed) == -EINVAL);
+	speed.wpm = 0;
+	speed.farnsworth_wpm = 0;
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_SPEED, (unsigned long)&speed) == -EINVAL);
+	speed.wpm = MAX_WPM + 1;
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_SPEED, (unsigned long)&speed) == -EINVAL);
+	device_close(&dev);
+}
+
+static struct device blocking_dev;
+static char blocking_text[600];
+static int blocking_result;
+
+static void *blocking_writer(void *unused)
+{
+	blocking_result = sim_write(&blocking_dev.inode, &blocking_dev.file,
+				    blocking_text, sizeof(blocking_text));
+	return NULL;
+}
+
+static void test_blocking_write(void)
+{
+	pthread_t thread;
+
+	CHECK(device_open(&blocking_dev, 4, 0) == 0);
+	memset(blocking_text, 'E', sizeof(blocking_text));
+	blocking_result = 0;
+
+	// The writer fills the buffer, starts transmitting and sleeps
+	pthread_create(&thread, NULL, blocking_writer, NULL);
+	sim_wait_sleepers(1);
+	CHECK(buffer_count(morse_devs[4]) == DEFAULT_BUFFER_SIZE);
+	CHECK(morse_devs[4]->is_transmitting);
+
+	sim_lock();
+	while (blocking_result == 0)
+	{
+		sim_unlock();
+		sim_advance(100);
+		sim_lock();
+	}
+	sim_unlock();
+	pthread_join(thread, NULL);
+	CHECK(blocking_result == sizeof(blocking_text));
+
+	device_close(&blocking_dev);
+	CHECK(sim_run_until_idle(1000000));
+	CHECK(sim_mod_use_count == 0);
+}
+
+static void test_close_while_transmitting(void)
+{
+	struct device dev;
+	unsigned long kfrees = sim_timer_kfrees;
+
+	// The buffer outlives the last close, and the timer ending the
+	// transmission leaves it alone
+	CHECK(device_open(&dev, 4, 0) == 0);
+	CHECK(device_write(&dev, "SOS") == 3);
+	device_close(&dev);
+	CHECK(morse_devs[4]->is_transmitting);
+	CHECK(morse_devs[4]->buffer != NULL);
+	CHECK(sim_run_until_idle(1000000));
+	CHECK(morse_devs[4]->buffer != NULL);
+	CHECK(sim_timer_kfrees == kfrees);
+	CHECK(sim_mod_use_count == 0);
+
+	// The next open takes it over, and a close while idle frees it
+	CHECK(device_open(&dev, 4, 0) == 0);
+	CHECK(device_write(&dev, "E") == 1);
+	CHECK(sim_run_until_idle(1000000));
+	device_close(&dev);
+	CHECK(morse_devs[4]->buffer == NULL);
+	CHECK(sim_mod_use_count == 0);
+}
+
+static void test_nonblocking_write(void)
+{
+	struct device dev;
+	char text[300];
+
+	memset(text, 'T', sizeof(text));
+	CHECK(device_open(&dev, 5, O_NONBLOCK) == 0);
+	CHECK(sim_select(&dev.inode, &dev.file, SEL_OUT) == 1);
+	CHECK(sim_write(&dev.inode, &dev.file, text, sizeof(text)) == DEFAULT_BUFFER_SIZE);
+	CHECK(sim_select(&dev.inode, &dev.file, SEL_OUT) == 0);
+	CHECK(sim_write(&dev.inode, &dev.file, text, sizeof(text)) == -EAGAIN);
+	CHECK(sim_fsync(&dev.inode, &dev.file) == -EAGAIN);
+
+	CHECK(sim_run_until_idle(1000000));
+	CHECK(sim_select(&dev.inode, &dev.file, SEL_OUT) == 1);
+	CHECK(sim_fsync(&dev.inode, &dev.file) == 0);
+	device_close(&dev);
+}
+
+static void test_resize_while_transmitting(void)
+{
+	struct device dev;
+	char text[101];
+	int i, on = 0;
+
+	memset(text, 'E', 100);
+	text[100] = '\0';
+	CHECK(device_open(&dev, 6, 0) == 0);
+	sim_trace_clear();
+	CHECK(device_write(&dev, text) == 100);
+	sim_advance(500);
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_BUFFER_SIZE, 10) == -EBUSY);
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_BUFFER_SIZE, 512) == 0);
+	CHECK(sim_run_until_idle(1000000));
+
+	// Every queued E was sent exactly once
+	for (i = 0; i < sim_trace_len; i++)
+		if (sim_trace[i].cell == 12 && sim_trace[i].value == ON)
+			on++;
+	CHECK(on == 100);
+	device_close(&dev);
+}
+
+static void test_outputs(void)
+{
+	struct device dev;
+	struct morse_screen config = {0, 3, 10, 0x22};
+	struct morse_event events[8];
+	struct morse_event_log log = {8, events};
+
+	CHECK(device_open(&dev, 7, 0) == 0);
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_SCREEN, (unsigned long)&config) == 0);
+	CHECK(device_write(&dev, "E") == 1);
+	sim_advance(10);
+	CHECK(sim_screen[3 * 80 + 10] == ((0x22 << 8) | ' '));
+	CHECK(sim_run_until_idle(100000));
+	CHECK(sim_screen[3 * 80 + 10] == ' ');
+
+	config.row = 25;
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_SCREEN, (unsigned long)&config) == -EINVAL);
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_OUTPUT, OUTPUTS_COUNT) == -EINVAL);
+
+	// The log is kept whatever the output: E from the screen, then A
+	// (dot, symbol pause, dash) with no other output
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_OUTPUT, MORSE_OUTPUT_LOG) == 0);
+	CHECK(device_write(&dev, "A") == 1);
+	CHECK(sim_run_until_idle(100000));
+	CHECK(sim_screen[3 * 80 + 10] == ' ');
+	CHECK(device_ioctl(&dev, MORSE_IOC_READ_EVENTS, (unsigned long)&log) == 0);
+	CHECK(log.count == 6);
+	CHECK(events[0].character == 'E' && events[1].character == 'E');
+	CHECK(events[1].time - events[0].time == 20);
+	CHECK(events[2].character == 'A' && events[5].character == 'A');
+	CHECK(events[2].state == 1 && events[3].state == 0);
+	CHECK(events[3].time - events[2].time == 20);
+	CHECK(events[4].time - events[3].time == 20);
+	CHECK(events[5].time - events[4].time == 60);
+
+	log.count = 8;
+	CHECK(device_ioctl(&dev, MORSE_IOC_READ_EVENTS, (unsigned long)&log) == 0);
+	CHECK(log.count == 0);
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_OUTPUT, MORSE_OUTPUT_SCREEN) == 0);
+	device_close(&dev);
+}
+
+static void test_flush(void)
+{
+	struct device dev;
+	unsigned int events;
+
+	CHECK(device_open(&dev, 1, 0) == 0);
+	CHECK(device_write(&dev, "TTTTTTTTTT") == 10);
+	sim_advance(30);
+	CHECK(sim_screen[2] == ON);
+
+	// The dash in progress is cut short and nothing else is sent
+	CHECK(device_ioctl(&dev, MORSE_IOC_FLUSH, 0) == 0);
+	CHECK(sim_screen[2] == ' ');
+	CHECK(!morse_devs[1]->is_transmitting);
+	CHECK(buffer_count(morse_devs[1]) == 0);
+	CHECK(sim_run_until_idle(100000));
+	CHECK(sim_screen[2] == ' ');
+	CHECK(sim_fsync(&dev.inode, &dev.file) == 0);
+
+	// The device is usable again afterwards
+	sim_trace_clear();
+	CHECK(device_write(&dev, "E") == 1);
+	CHECK(sim_run_until_idle(100000));
+	CHECK(sim_trace_len == 2);
+
+	// Flushing between two letters logs no transition, the signal
+	// being off already
+	CHECK(device_write(&dev, "TT") == 2);
+	sim_advance(1 + 60 + 10);
+	CHECK(!morse_devs[1]->signal_state);
+	events = morse_devs[1]->event_in;
+	CHECK(device_ioctl(&dev, MORSE_IOC_FLUSH, 0) == 0);
+	CHECK(morse_devs[1]->event_in == events);
+	device_close(&dev);
+}
+
+static void test_urgent(void)
+{
+	struct device dev;
+	struct morse_message message = {1, "T"};
+	// E E, then T at the next letter boundary with word pauses around
+	// it, then the remaining E E E
+	static const unsigned long text[] = {
+		0, 20, 80, 100,
+		240, 300,
+		440, 460, 520, 540, 600, 620};
+
+	CHECK(device_open(&dev, 4, 0) == 0);
+	CHECK(device_write(&dev, "EEEEE") == 5);
+	sim_advance(85);
+	CHECK(device_ioctl(&dev, MORSE_IOC_URGENT, (unsigned long)&message) == 0);
+	CHECK(sim_run_until_idle(100000));
+	CHECK(check_timeline(8, text, 12));
+
+	message.length = URGENT_SIZE + 1;
+	CHECK(device_ioctl(&dev, MORSE_IOC_URGENT, (unsigned long)&message) == -EMSGSIZE);
+	message.length = 0;
+	CHECK(device_ioctl(&dev, MORSE_IOC_URGENT, (unsigned long)&message) == -EINVAL);
+	device_close(&dev);
+}
+
+// Writes text to an idle device and compares the estimate read straight
+// away with how long the transmission then really takes
+static int eta_matches(struct device *dev, const char *text)
+{
+	struct morse_status status;
+	unsigned long start = jiffies;
+
+	if (device_write(dev, text) != strlen(text) ||
+	    device_ioctl(dev, MORSE_IOC_GET_STATUS, (unsigned long)&status) != 0 ||
+	    !sim_run_until_idle(100000))
+		return 0;
+	if (status.eta != (jiffies - start) * 1000 / HZ)
+	{
+		printf("  \"%s\": eta %lu ms, sent in %lu ms\n", text, status.eta,
+		       (jiffies - start) * 1000 / HZ);
+		return 0;
+	}
+	return 1;
+}
+
+static void test_status(void)
+{
+	struct device dev;
+	struct morse_status before, status;
+	struct morse_message message = {1, "T"};
+	char proc[1024];
+
+	CHECK(device_open(&dev, 6, 0) == 0);
+	CHECK(device_ioctl(&dev, MORSE_IOC_GET_STATUS, (unsigned long)&before) == 0);
+	CHECK(!before.transmitting && before.element == MORSE_ELEMENT_NONE);
+	CHECK(before.current_char == -1 && before.queued == 0 && before.eta == 0);
+
+	// S and S are 1600 ms with their letter pauses, O is 2800 ms, and the
+	// timer starts a jiffy after the write
+	CHECK(device_write(&dev, "S#OS") == 4);
+	CHECK(device_ioctl(&dev, MORSE_IOC_GET_STATUS, (unsigned long)&status) == 0);
+	CHECK(status.transmitting && status.queued == 4);
+	CHECK(status.eta == 6010);
+
+	// Into the first dash of O, the # having been skipped
+	sim_advance(1 + 160 + 10);
+	CHECK(device_ioctl(&dev, MORSE_IOC_GET_STATUS, (unsigned long)&status) == 0);
+	CHECK(status.current_char == 'O' && status.element == MORSE_ELEMENT_DASH);
+	CHECK(status.queued == 1);
+	CHECK(status.eta == 6010 - 1710);
+
+	// Between the dashes
+	sim_advance(50);
+	CHECK(device_ioctl(&dev, MORSE_IOC_GET_STATUS, (unsigned long)&status) == 0);
+	CHECK(status.element == MORSE_ELEMENT_SYMBOL_PAUSE);
+	CHECK(status.eta == 6010 - 2210);
+
+	CHECK(sim_run_until_idle(100000));
+	CHECK(device_ioctl(&dev, MORSE_IOC_GET_STATUS, (unsigned long)&status) == 0);
+	CHECK(!status.transmitting && status.eta == 0);
+	CHECK(status.chars_sent - before.chars_sent == 3);
+	CHECK(status.chars_skipped - before.chars_skipped == 1);
+	CHECK(status.timer_overruns == before.timer_overruns);
+
+	CHECK(sim_proc_read("morse", proc, sizeof(proc)) > 0);
+	CHECK(strncmp(proc, "minor", 5) == 0);
+	CHECK(strstr(proc, "\n    6  0      0   -1       0      0") != NULL);
+
+	// Past the deadline with the timer still to run, nothing is left
+	// of the current element
+	CHECK(device_write(&dev, "E") == 1);
+	sim_lock();
+	jiffies += 5;
+	sim_unlock();
+	CHECK(device_ioctl(&dev, MORSE_IOC_GET_STATUS, (unsigned long)&status) == 0);
+	CHECK(status.eta == 800);
+	CHECK(sim_run_until_idle(100000));
+
+	// Spaces after a line break, another space or nothing at all are
+	// whole word pauses: the estimate matches what the timer takes
+	CHECK(eta_matches(&dev, "E\r\nE"));
+	CHECK(eta_matches(&dev, "E  E"));
+	CHECK(eta_matches(&dev, " E"));
+	CHECK(eta_matches(&dev, "E #E "));
+
+	// An urgent message goes first, and a word pause parts it from the
+	// text: 600 ms of T, 1400 ms, then E and E with their letter pauses
+	CHECK(device_write(&dev, "EE") == 2);
+	CHECK(device_ioctl(&dev, MORSE_IOC_URGENT, (unsigned long)&message) == 0);
+	CHECK(device_ioctl(&dev, MORSE_IOC_GET_STATUS, (unsigned long)&status) == 0);
+	CHECK(status.eta == 10 + 600 + 1400 + 800 + 800);
+	CHECK(sim_run_until_idle(100000));
+	device_close(&dev);
+}
+
+static void test_beacon(void)
+{
+	struct device dev;
+	struct morse_beacon config = {3, " E ", 400};
+	// E every 2 s, a word pause and 400 ms apart; T is sent in the gap
+	// and the beacon starts over a word pause after it
+	static const unsigned long expected[] = {0, 20, 200, 260, 400, 420};
+	// Without a gap the repeats are still a word pause apart
+	static const unsigned long no_gap[] = {0, 20, 160, 180};
+
+	CHECK(device_open(&dev, 5, O_NONBLOCK) == 0);
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_BEACON, (unsigned long)&config) == 0);
+	CHECK(morse_devs[5]->beacon_length == 1);
+	CHECK(sim_fsync(&dev.inode, &dev.file) == 0);
+
+	sim_advance(1 + 150);
+	CHECK(device_write(&dev, "T") == 1);
+	CHECK(sim_fsync(&dev.inode, &dev.file) == -EAGAIN);
+	sim_advance(300);
+	CHECK(morse_devs[5]->is_transmitting);
+	CHECK(sim_fsync(&dev.inode, &dev.file) == 0);
+	sim_advance(100);
+
+	// An empty message stops the beacon once the gap is over
+	config.length = 0;
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_BEACON, (unsigned long)&config) == 0);
+	CHECK(sim_run_until_idle(1000));
+	CHECK(check_timeline(10, expected, 6));
+
+	sim_trace_clear();
+	config.text = "E";
+	config.length = 1;
+	config.gap = 0;
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_BEACON, (unsigned long)&config) == 0);
+	sim_advance(1 + 170);
+	config.length = 0;
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_BEACON, (unsigned long)&config) == 0);
+	CHECK(sim_run_until_idle(1000));
+	CHECK(check_timeline(10, no_gap, 4));
+
+	config.text = "###";
+	config.length = 3;
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_BEACON, (unsigned long)&config) == -EINVAL);
+	config.length = BEACON_SIZE + 1;
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_BEACON, (unsigned long)&config) == -EMSGSIZE);
+	CHECK(!morse_devs[5]->is_transmitting);
+	device_close(&dev);
+}
+
+static struct device reader;
+static struct morse_event read_events_buf[8];
+static int read_result;
+
+static void *blocking_reader(void *unused)
+{
+	read_result = sim_read(&reader.inode, &reader.file, (char *)read_events_buf,
+			       sizeof(read_events_buf));
+	return NULL;
+}
+
+static void test_read(void)
+{
+	struct device dev;
+	struct morse_event events[8];
+	struct morse_status before, status;
+	char text[66];
+	int result, count = 0;
+	pthread_t thread;
+
+	CHECK(device_open(&dev, 6, O_NONBLOCK) == 0);
+	CHECK(sim_read(&dev.inode, &dev.file, (char *)events, sizeof(events)) == -EAGAIN);
+	CHECK(sim_read(&dev.inode, &dev.file, (char *)events, 4) == -EINVAL);
+	CHECK(sim_select(&dev.inode, &dev.file, SEL_IN) == 0);
+
+	// E, letter pause, T
+	CHECK(device_write(&dev, "ET") == 2);
+	CHECK(sim_run_until_idle(1000));
+	CHECK(sim_select(&dev.inode, &dev.file, SEL_IN) == 1);
+	CHECK(sim_read(&dev.inode, &dev.file, (char *)events, sizeof(events)) ==
+	      4 * sizeof(struct morse_event));
+	CHECK(events[0].state == 1 && events[0].character == 'E');
+	CHECK(events[1].state == 0 && events[1].time - events[0].time == 20);
+	CHECK(events[2].state == 1 && events[2].character == 'T');
+	CHECK(events[2].time - events[1].time == 60);
+	CHECK(events[3].state == 0 && events[3].time - events[2].time == 60);
+
+	// A blocking reader wakes up at the first transition
+	CHECK(device_open(&reader, 6, 0) == 0);
+	read_result = 0;
+	pthread_create(&thread, NULL, blocking_reader, NULL);
+	sim_wait_sleepers(1);
+	CHECK(device_write(&dev, "E") == 1);
+	sim_advance(1);
+	pthread_join(thread, NULL);
+	CHECK(read_result == sizeof(struct morse_event));
+	CHECK(read_events_buf[0].state == 1 && read_events_buf[0].character == 'E');
+
+	CHECK(sim_run_until_idle(1000));
+	CHECK(sim_read(&dev.inode, &dev.file, (char *)events, sizeof(events)) ==
+	      sizeof(struct morse_event));
+	device_close(&reader);
+
+	// With nobody reading, 65 Es make two transitions more than the
+	// log holds: they are dropped, and counted
+	CHECK(device_ioctl(&dev, MORSE_IOC_GET_STATUS, (unsigned long)&before) == 0);
+	memset(text, 'E', 65);
+	text[65] = '\0';
+	CHECK(device_write(&dev, text) == 65);
+	CHECK(sim_run_until_idle(100000));
+	CHECK(device_ioctl(&dev, MORSE_IOC_GET_STATUS, (unsigned long)&status) == 0);
+	CHECK(status.events_lost - before.events_lost == 2);
+	while ((result = sim_read(&dev.inode, &dev.file, (char *)events, sizeof(events))) > 0)
+		count += result / sizeof(struct morse_event);
+	CHECK(count == EVENT_LOG_SIZE);
+	device_close(&dev);
+}
+
+// Encodes text on device 0 into the event log, and replays the log into
+// a decoder as samples in the given unit (per jiffy)
+static void encode_decode(const char *text, int wpm, int unit, char *result, int size)
+{
+	struct device dev, decoder;
+	struct morse_speed speed = {wpm, 0};
+	struct morse_event events[EVENT_LOG_SIZE];
+	struct morse_event_log log;
+	struct morse_sample samples[EVENT_LOG_SIZE];
+	unsigned long last = 0;
+	int i, n, done, length;
+
+	CHECK(device_open(&dev, 0, 0) == 0);
+	CHECK(device_open(&decoder, DECODER_MINOR, 0) == 0);
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_OUTPUT, MORSE_OUTPUT_LOG) == 0);
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_SPEED, (unsigned long)&speed) == 0);
+	CHECK(device_write(&dev, text) == strlen(text));
+
+	do
+	{
+		sim_advance(50);
+		done = !morse_devs[0]->is_transmitting;
+		log.count = EVENT_LOG_SIZE;
+		log.events = events;
+		CHECK(device_ioctl(&dev, MORSE_IOC_READ_EVENTS, (unsigned long)&log) == 0);
+		for (i = 0, n = 0; i < log.count; i++)
+		{
+			if (last != 0)
+			{
+				samples[n].state = !events[i].state;
+				samples[n].duration = (events[i].time - last) * unit;
+				n++;
+			}
+			last = events[i].time;
+		}
+		n *= sizeof(struct morse_sample);
+		CHECK(sim_write(&decoder.inode, &decoder.file, (char *)samples, n) == n);
+	} while (!done);
+	CHECK(morse_devs[0]->events_lost == 0);
+
+	CHECK(sim_fsync(&decoder.inode, &decoder.file) == 0);
+	length = sim_read(&decoder.inode, &decoder.file, result, size - 1);
+	result[length > 0 ? length : 0] = '\0';
+
+	device_close(&decoder);
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_OUTPUT, MORSE_OUTPUT_SCREEN) == 0);
+	speed.wpm = 6; // back to the defaults
+	CHECK(device_ioctl(&dev, MORSE_IOC_SET_SPEED, (unsigned long)&speed) == 0);
+	device_close(&dev);
+}
+
+static void test_decoder(void)
+{
+	char result[64];
+
+	encode_decode("HELLO WORLD 123", 30, 10, result, sizeof(result));
+	CHECK(strcmp(result, "HELLO WORLD 123") == 0);
+
+	// Starting with a dash, at another speed and in another unit
+	encode_decode("TEST 2", 12, 1, result, sizeof(result));
+	CHECK(strcmp(result, "TEST 2") == 0);
+}
+
+static void test_code_table(void)
+{
+	char result[64];
+
+	// Lower case, punctuation and prosigns; '#' has no code and is skipped
+	encode_decode("de k1abc: qrl? #73 (5/9) \001\004\007\010",
+		      30, 10, result, sizeof(result));
+	CHECK(strcmp(result, "DE K1ABC: QRL? 73 (5/9) \001\004\007\010") == 0);
+	encode_decode(".,'!&;=+-_\"$@", 30, 10, result, sizeof(result));
+	CHECK(strcmp(result, ".,'!&;=+-_\"$@") == 0);
+}
+
+static void test_decoder_adaptive(void)
+{
+	struct device decoder;
+	// "PARIS PARIS" with the second word sent 25% faster
+	static const char *codes[] = {".--.", ".-", ".-.", "..", "..."};
+	struct morse_sample samples[64];
+	char result[32];
+	int i, j, k, n = 0, unit;
+
+	for (k = 0; k < 2; k++)
+	{
+		unit = k == 0 ? 100 : 80;
+		for (i = 0; i < 5; i++)
+		{
+			for (j = 0; codes[i][j]; j++)
+			{
+				samples[n].state = 1;
+				samples[n++].duration = codes[i][j] == '.' ? unit : 3 * unit;
+				samples[n].state = 0;
+				samples[n++].duration = codes[i][j + 1] ? unit : 3 * unit;
+			}
+		}
+		samples[n - 1].duration = 7 * unit;
+	}
+
+	CHECK(device_open(&decoder, DECODER_MINOR + 1, 0) == 0);
+	CHECK(sim_write(&decoder.inode, &decoder.file, (char *)samples,
+			n * sizeof(struct morse_sample)) == n * sizeof(struct morse_sample));
+	CHECK(sim_write(&decoder.inode, &decoder.file, (char *)samples, 3) == -EINVAL);
+	n = sim_read(&decoder.inode, &decoder.file, result, sizeof(result) - 1);
+	result[n > 0 ? n : 0] = '\0';
+	CHECK(strcmp(result, "PARIS PARIS ") == 0);
+	device_close(&decoder);
+}
+
+// ring.c, linked in with its module entry points renamed
+#define RING_MAJOR 60
+#define RING_IOC_SETBUFSIZE _IOW(RING_MAJOR, 1, int)
+extern int ring_init_module(void);
+extern int buffercount[];
+
+static struct device ring_writer;
+static char ring_text[260];
+static int ring_result;
+
+static void *blocking_ring_writer(void *unused)
+{
+	ring_result = sim_write(&ring_writer.inode, &ring_writer.file, ring_text, sizeof(ring_text));
+	return NULL;
+}
+
+static void test_ring_feed(void)
+{
+	struct device dev, other;
+	struct morse_event events[8];
+	struct morse_status status;
+	pthread_t thread;
+
+	CHECK(device_open(&dev, 1, O_NONBLOCK) == 0);
+	CHECK(device_open(&other, 2, 0) == 0);
+	sim_file_init(&ring_writer.inode, &ring_writer.file, RING_MAJOR, 0, 0);
+	CHECK(sim_open(&ring_writer.inode, &ring_writer.file) == 0);
+
+	CHECK(device_ioctl(&dev, MORSE_IOC_ATTACH_RING, 4) == -ENODEV);
+	CHECK(device_ioctl(&dev, MORSE_IOC_ATTACH_RING, 0) == 0);
+	CHECK(device_ioctl(&dev, MORSE_IOC_ATTACH_RING, 0) == 0);
+	CHECK(device_ioctl(&other, MORSE_IOC_ATTACH_RING, 0) == -EBUSY);
+	device_close(&other);
+
+	// What is written to the ring is sent with nobody reading it
+	CHECK(sim_write(&ring_writer.inode, &ring_writer.file, "ET", 2) == 2);
+	CHECK(morse_devs[1]->is_transmitting);
+	CHECK(sim_fsync(&dev.inode, &dev.file) == -EAGAIN);
+
+	// The ring's bytes count as queued: a jiffy before the timer first
+	// runs, 800 ms for E and its letter pause, 1200 ms for T
+	CHECK(device_ioctl(&dev, MORSE_IOC_GET_STATUS, (unsigned long)&status) == 0);
+	CHECK(status.queued == 2);
+	CHECK(status.eta == 10 + 800 + 1200);
+	CHECK(sim_run_until_idle(1000));
+	CHECK(buffercount[0] == 0);
+	CHECK(sim_read(&dev.inode, &dev.file, (char *)events, sizeof(events)) ==
+	      4 * sizeof(struct morse_event));
+	CHECK(events[0].state == 1 && events[0].character == 'E');
+	CHECK(events[1].time - events[0].time == 20);
+	CHECK(events[2].state == 1 && events[2].character == 'T');
+	CHECK(events[2].time - events[1].time == 60);
+
+	// A writer sleeping on the full ring is woken as the device takes
+	// bytes out of it
+	memset(ring_text, 'E', sizeof(ring_text));
+	ring_result = 0;
+	CHECK(sim_ioctl(&ring_writer.inode, &ring_writer.file, RING_IOC_SETBUFSIZE, 256) == 0);
+	pthread_create(&thread, NULL, blocking_ring_writer, NULL);
+	sim_wait_sleepers(1);
+	CHECK(buffercount[0] == 256);
+	sim_lock();
+	while (ring_result == 0)
+	{
+		sim_unlock();
+		sim_advance(100);
+		sim_lock();
+	}
+	sim_unlock();
+	pthread_join(thread, NULL);
+	CHECK(ring_result == sizeof(ring_text));
+	CHECK(sim_run_until_idle(100000));
+	CHECK(buffercount[0] == 0);
+
+	// Once detached the ring keeps what is written to it
+	CHECK(device_ioctl(&dev, MORSE_IOC_ATTACH_RING, -1) == 0);
+	CHECK(sim_write(&ring_writer.inode, &ring_writer.file, "E", 1) == 1);
+	CHECK(!morse_devs[1]->is_transmitting);
+	CHECK(buffercount[0] == 1);
+	sim_release(&ring_writer.inode, &ring_writer.file);
+	device_close(&dev);
+}
+
+// Reloads the module, so it must run last
+static void test_device_count(void)
+{
+	struct device dev;
+	char proc[8192];
+	char *line;
+	int lines = 0;
+
+	cleanup_module();
+	devices = 0;
+	CHECK(init_module() == -EINVAL);
+	devices = MAX_DEVICES + 1;
+	CHECK(init_module() == -EINVAL);
+
+	devices = 100;
+	CHECK(init_module() == 0);
+
+	// Device 99 lights the cell after device 98, on the third row
+	CHECK(device_open(&dev, 99, 0) == 0);
+	CHECK(device_write(&dev, "E") == 1);
+	sim_advance(1);
+	CHECK(sim_screen[2 * 80 + 38] == ON);
+	CHECK(sim_run_until_idle(1000));
+	device_close(&dev);
+	CHECK(device_open(&dev, 100, 0) == -ENODEV);
+
+	// The table is longer than a page of /proc
+	CHECK(sim_proc_read("morse", proc, sizeof(proc)) > 4096);
+	for (line = proc; (line = strchr(line, '\n')) != NULL; line++)
+		lines++;
+	CHECK(lines == 1 + 100);
+	CHECK(strstr(proc, "\n   99  0") != NULL);
+}
+
+static struct
+{
+	const char *name;
+	void (*run)(void);
+} tests[] = {
+	{"default timeline", test_default_timeline},
+	{"word pause", test_word_pause},
+	{"speed", test_speed},
+	{"farnsworth", test_farnsworth},
+	{"blocking write", test_blocking_write},
+	{"close while transmitting", test_close_while_transmitting},
+	{"non-blocking write", test_nonblocking_write},
+	{"resize while transmitting", test_resize_while_transmitting},
+	{"outputs", test_outputs},
+	{"flush", test_flush},
+	{"urgent", test_urgent},
+	{"status", test_status},
+	{"beacon", test_beacon},
+	{"read", test_read},
+	{"decoder", test_decoder},
+	{"code table", test_code_table},
+	{"adaptive decoder", test_decoder_adaptive},
+	{"ring feed", test_ring_feed},
+	{"device count", test_device_count},
+};
+
+int main()
+{
+	int i, before;
+
+	sim_init();
+	if (ring_init_module() != 0 || init_module() != 0)
+	{
+		printf("init_module failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+	{
+		before = failures;
+		sim_trace_clear();
+		tests[i].run();
+		printf("%s: %s\n", failures == before ? "PASS" : "FAIL", tests[i].name);
+	}
+
+	cleanup_module();
+	return failures != 0;
+}
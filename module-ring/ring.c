@@ -14,6 +14,7 @@ Zajączkowski Piotr
 #include <linux/malloc.h>
 #include <linux/ioctl.h>
 #include <asm/semaphore.h>
+#include <asm/system.h>
 
 #define BUFFERSIZE 1024
 #define BUFFERS_COUNT 4
@@ -33,6 +34,15 @@ struct semaphore sem[BUFFERS_COUNT];
 
 struct wait_queue *read_queue[BUFFERS_COUNT], *write_queue[BUFFERS_COUNT];
 
+/*
+ * In-kernel consumer of each buffer, see ring_attach(). A consumer takes
+ * bytes from timer context, so start, end and buffercount are only ever
+ * changed with interrupts disabled; sem still serializes opening,
+ * closing and resizing.
+ */
+static void (*consumer_notify[BUFFERS_COUNT])(unsigned long);
+static unsigned long consumer_data[BUFFERS_COUNT];
+
 int get_minor(struct inode *inode)
 {
 	int minor;
@@ -44,15 +54,9 @@ int get_minor(struct inode *inode)
 	return minor;
 }
 
-int ring_open(struct inode *inode, struct file *file)
+/* Takes a reference to the buffer, allocating it for the first user. Called with sem held. */
+static int ring_hold(int minor)
 {
-	int minor = get_minor(inode);
-	if (minor < 0)
-	{
-		return minor;
-	}
-	down(&sem[minor]);
-	MOD_INC_USE_COUNT;
 	usecount[minor]++;
 	if (usecount[minor] == 1)
 	{
@@ -60,8 +64,6 @@ int ring_open(struct inode *inode, struct file *file)
 		if (buffer[minor] == NULL)
 		{
 			usecount[minor]--;
-			MOD_DEC_USE_COUNT;
-			up(&sem[minor]);
 			return -ENOMEM;
 		}
 
@@ -70,10 +72,56 @@ int ring_open(struct inode *inode, struct file *file)
 		start[minor] = 0;
 		end[minor] = 0;
 	}
-	up(&sem[minor]);
+	MOD_INC_USE_COUNT;
 	return 0;
 }
 
+/* Drops a reference taken by ring_hold(). Called with sem held. */
+static void ring_unhold(int minor)
+{
+	usecount[minor]--;
+	if (usecount[minor] == 0)
+		kfree(buffer[minor]);
+	MOD_DEC_USE_COUNT;
+}
+
+/* Takes one byte out of the buffer, if there is one */
+static int ring_get(int minor)
+{
+	unsigned long flags;
+	int ch = -1;
+
+	save_flags(flags);
+	cli();
+	if (buffercount[minor] > 0)
+	{
+		ch = (unsigned char)buffer[minor][start[minor]];
+		start[minor]++;
+		if (start[minor] == buffersize[minor])
+			start[minor] = 0;
+		buffercount[minor]--;
+	}
+	restore_flags(flags);
+
+	if (ch >= 0)
+		wake_up(&write_queue[minor]);
+	return ch;
+}
+
+int ring_open(struct inode *inode, struct file *file)
+{
+	int result;
+	int minor = get_minor(inode);
+	if (minor < 0)
+	{
+		return minor;
+	}
+	down(&sem[minor]);
+	result = ring_hold(minor);
+	up(&sem[minor]);
+	return result;
+}
+
 void ring_release(struct inode *inode, struct file *file)
 {
 	int minor = get_minor(inode);
@@ -83,18 +131,15 @@ void ring_release(struct inode *inode, struct file *file)
 	}
 
 	down(&sem[minor]);
-	usecount[minor]--;
-	if (usecount[minor] == 0)
-		kfree(buffer[minor]);
+	ring_unhold(minor);
 	up(&sem[minor]);
-
-	MOD_DEC_USE_COUNT;
 }
 
 int ring_read(struct inode *inode, struct file *file, char *pB, int count)
 {
 	int i;
-	char tmp;
+	int tmp;
+	unsigned long flags;
 	int minor = get_minor(inode);
 	if (minor < 0)
 	{
@@ -102,12 +147,18 @@ int ring_read(struct inode *inode, struct file *file, char *pB, int count)
 	}
 	for (i = 0; i < count; i++)
 	{
-		while (buffercount[minor] == 0)
+		/* A consumer may take the byte between the check and ring_get() */
+		while ((tmp = ring_get(minor)) < 0)
 		{
-			if (usecount[minor] == 1)
+			/* Nobody else has the buffer open: nothing more will come */
+			if (usecount[minor] - (consumer_notify[minor] != NULL) == 1)
 				return i;
 
-			interruptible_sleep_on(&read_queue[minor]);
+			save_flags(flags);
+			cli();
+			if (buffercount[minor] == 0)
+				interruptible_sleep_on(&read_queue[minor]);
+			restore_flags(flags);
 
 			if (current->signal & ~current->blocked)
 			{
@@ -117,15 +168,6 @@ int ring_read(struct inode *inode, struct file *file, char *pB, int count)
 			}
 		}
 
-		down(&sem[minor]);
-		tmp = buffer[minor][start[minor]];
-		start[minor]++;
-		if (start[minor] == buffersize[minor])
-			start[minor] = 0;
-		buffercount[minor]--;
-		up(&sem[minor]);
-
-		wake_up(&write_queue[minor]);
 		put_user(tmp, pB + i);
 	}
 	return count;
@@ -135,6 +177,7 @@ int ring_write(struct inode *inode, struct file *file, const char *pB, int count
 {
 	int i;
 	char tmp;
+	unsigned long flags;
 	int minor = get_minor(inode);
 	if (minor < 0)
 	{
@@ -143,26 +186,32 @@ int ring_write(struct inode *inode, struct file *file, const char *pB, int count
 	for (i = 0; i < count; i++)
 	{
 		tmp = get_user(pB + i);
+
+		/* Checking for room and going to sleep must be atomic with respect to a consumer */
+		save_flags(flags);
+		cli();
 		while (buffercount[minor] == buffersize[minor])
 		{
 			interruptible_sleep_on(&write_queue[minor]);
 			if (current->signal & ~current->blocked)
 			{
+				restore_flags(flags);
 				if (i == 0)
 					return -ERESTARTSYS;
 				return i;
 			}
 		}
 
-		down(&sem[minor]);
 		buffer[minor][end[minor]] = tmp;
 		buffercount[minor]++;
 		end[minor]++;
 		if (end[minor] == buffersize[minor])
 			end[minor] = 0;
-		up(&sem[minor]);
+		restore_flags(flags);
 
 		wake_up(&read_queue[minor]);
+		if (consumer_notify[minor] != NULL)
+			consumer_notify[minor](consumer_data[minor]);
 	}
 	return count;
 }
@@ -170,8 +219,9 @@ int ring_write(struct inode *inode, struct file *file, const char *pB, int count
 int ring_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg)
 {
 	int new_size, i;
-	char *new_buffer;
+	char *new_buffer, *old_buffer;
 	int old_size;
+	unsigned long flags;
 	int minor = get_minor(inode);
 	if (minor < 0)
 	{
@@ -204,13 +254,6 @@ int ring_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigne
 
 		down(&sem[minor]);
 
-		if (new_size < buffercount[minor]){
-			up(&sem[minor]);
-			return -EBUSY;
-		}
-
-		old_size = buffersize[minor];
-
 		new_buffer = kmalloc(new_size, GFP_KERNEL);
 		if (new_buffer == NULL)
 		{
@@ -218,6 +261,18 @@ int ring_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigne
 			return -ENOMEM;
 		}
 
+		/* Readers, writers and a consumer may all run meanwhile */
+		save_flags(flags);
+		cli();
+		if (new_size < buffercount[minor]){
+			restore_flags(flags);
+			up(&sem[minor]);
+			kfree(new_buffer);
+			return -EBUSY;
+		}
+
+		old_size = buffersize[minor];
+
 		for (i = 0; i < buffercount[minor]; i++)
 		{
 			int old_index = (start[minor] + i) % old_size;
@@ -227,11 +282,13 @@ int ring_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigne
 		start[minor] = 0;
 		end[minor] = buffercount[minor] % new_size;
 
-		kfree(buffer[minor]);
+		old_buffer = buffer[minor];
 		buffer[minor] = new_buffer;
 		buffersize[minor] = new_size;
+		restore_flags(flags);
 
 		up(&sem[minor]);
+		kfree(old_buffer);
 
 		if (buffercount[minor] < new_size)
 			wake_up(&write_queue[minor]);
@@ -247,6 +304,92 @@ int ring_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigne
 	}
 }
 
+/*
+ * In-kernel consumer API, exported to other modules.
+ *
+ * A consumer attached to a minor keeps its buffer alive like an open
+ * file does, and takes bytes with ring_consume() from any context,
+ * competing with readers if there are any. notify(data) is called from
+ * the writer's process context after every byte written, so that an
+ * idle consumer knows to start again. A minor has at most one consumer.
+ */
+int ring_attach(int minor, void (*notify)(unsigned long), unsigned long data)
+{
+	int result;
+
+	if (minor < 0 || minor >= BUFFERS_COUNT)
+		return -ENODEV;
+
+	down(&sem[minor]);
+	if (consumer_notify[minor] != NULL)
+	{
+		up(&sem[minor]);
+		return -EBUSY;
+	}
+	result = ring_hold(minor);
+	if (result == 0)
+	{
+		consumer_data[minor] = data;
+		consumer_notify[minor] = notify;
+	}
+	up(&sem[minor]);
+	return result;
+}
+
+void ring_detach(int minor)
+{
+	down(&sem[minor]);
+	consumer_notify[minor] = NULL;
+	ring_unhold(minor);
+	up(&sem[minor]);
+}
+
+/* Number of bytes waiting in the buffer */
+int ring_count(int minor)
+{
+	return buffercount[minor];
+}
+
+/*
+ * The byte offset places after the next one ring_consume() would return,
+ * or -1 if the buffer holds no more than offset bytes
+ */
+int ring_peek_at(int minor, int offset)
+{
+	unsigned long flags;
+	int ch = -1;
+
+	save_flags(flags);
+	cli();
+	if (offset >= 0 && offset < buffercount[minor])
+		ch = (unsigned char)buffer[minor][(start[minor] + offset) % buffersize[minor]];
+	restore_flags(flags);
+	return ch;
+}
+
+/* The next byte ring_consume() would return, or -1 if the buffer is empty */
+int ring_peek(int minor)
+{
+	return ring_peek_at(minor, 0);
+}
+
+/* Takes the next byte, or returns -1 if the buffer is empty. Never sleeps. */
+int ring_consume(int minor)
+{
+	return ring_get(minor);
+}
+
+static struct symbol_table ring_syms = {
+#include <linux/symtab_begin.h>
+	X(ring_attach),
+	X(ring_detach),
+	X(ring_count),
+	X(ring_peek_at),
+	X(ring_peek),
+	X(ring_consume),
+#include <linux/symtab_end.h>
+};
+
 struct file_operations ring_ops = {
 	read : ring_read,
 	write : ring_write,
@@ -274,6 +417,7 @@ int init_module()
 	int result = ring_init();
 	if (!result)
 	{
+		register_symtab(&ring_syms);
 		printk("Ring device initialized!\n");
 	}
 